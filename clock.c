@@ -10,9 +10,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <sys/times.h>
 #include "clock.h"
 
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
 
 /******************************************************* 
  * Machine dependent functions 
@@ -35,13 +40,69 @@ static unsigned cyc_lo = 0;
 
 
 /* Set *hi and *lo to the high and low order bits  of the cycle counter.  
-   Implementation requires assembly code to use the rdtsc instruction. */
-void access_counter(unsigned *hi, unsigned *lo)
+   Implementation requires assembly code to use the rdtsc instruction.
+   The read is fenced on both sides so that it neither runs ahead of the
+   code before it nor lets the code after it start early: rdtscp waits
+   for what comes before, and lfence holds back what comes after. */
+static void access_rdtscp(unsigned *hi, unsigned *lo)
+{
+    asm volatile("rdtscp; lfence"
+		 : "=a" (*lo), "=d" (*hi)
+		 : /* No input */
+		 : "%ecx", "memory");
+}
+
+/* Without rdtscp, an lfence in front does the waiting */
+static void access_rdtsc(unsigned *hi, unsigned *lo)
+{
+    asm volatile("lfence; rdtsc; lfence"
+		 : "=a" (*lo), "=d" (*hi)
+		 : /* No input */
+		 : "memory");
+}
+
+/* The read to use, picked once at startup rather than on every read */
+static void (*access_counter)(unsigned *hi, unsigned *lo) = access_rdtsc;
+
+static void __attribute__((constructor)) pick_counter(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid(0x80000001, &a, &b, &c, &d) && (d & (1 << 27)))
+	access_counter = access_rdtscp;
+}
+
+/* The TSC rate the processor (or hypervisor) states, in MHz, or 0.
+   Leaf 0x15 gives the ratio of the TSC to the crystal clock, and on
+   most parts the crystal rate; leaf 0x16 gives the base clock, which
+   an invariant TSC runs at; hypervisors put the rate in 0x40000010.
+   Leaves from 0x40000000 up are only asked if CPUID.1:ECX[31] says
+   there is a hypervisor: on bare metal they return whatever the
+   highest basic leaf holds. */
+static double cpuid_mhz(void)
 {
-    asm("rdtsc; movl %%edx,%0; movl %%eax,%1"   /* Read cycle counter */
-	: "=r" (*hi), "=r" (*lo)                /* and move results to */
-	: /* No input */                        /* the two outputs */
-	: "%edx", "%eax");
+    unsigned a, b, c, d, max = __get_cpuid_max(0, NULL);
+
+    if (max >= 0x15) {
+	__cpuid(0x15, a, b, c, d);
+	if (a && b && c)
+	    return (double)c * b / a / 1e6;
+    }
+    if (max >= 0x16 && __get_cpuid(0x80000007, &a, &b, &c, &d)
+	&& (d & (1 << 8))) {
+	__cpuid(0x16, a, b, c, d);
+	if (a & 0xffff)
+	    return a & 0xffff;
+    }
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & (1u << 31)))
+	return 0;
+    __cpuid(0x40000000, a, b, c, d);
+    if (a >= 0x40000010) {
+	__cpuid(0x40000010, a, b, c, d);
+	if (a)
+	    return a / 1e3;
+    }
+    return 0;
 }
 
 /* Record the current value of the cycle counter. */
@@ -50,6 +111,15 @@ void start_counter()
     access_counter(&cyc_hi, &cyc_lo);
 }
 
+/* Return the raw value of the cycle counter. */
+unsigned long long read_counter()
+{
+    unsigned hi, lo;
+
+    access_counter(&hi, &lo);
+    return ((unsigned long long) hi << 32) | lo;
+}
+
 /* Return the number of cycles since the last call to start_counter. */
 double get_counter()
 {
@@ -117,6 +187,16 @@ void start_counter()
     cyc_lo = counter();
 }
 
+unsigned long long read_counter()
+{
+    return counter();
+}
+
+static double cpuid_mhz(void)
+{
+    return 0;
+}
+
 double get_counter()
 {
     unsigned ncyc_hi, ncyc_lo;
@@ -159,6 +239,18 @@ double get_counter()
     printf("Please choose another timing package in config.h.\n");
     exit(1);
 }
+
+unsigned long long read_counter()
+{
+    printf("ERROR: You are trying to use a read_counter routine in clock.c\n");
+    printf("that has not been implemented yet on this platform.\n");
+    exit(1);
+}
+
+static double cpuid_mhz(void)
+{
+    return 0;
+}
 #endif
 
 
@@ -180,26 +272,102 @@ double ovhd()
     return result;
 }
 
-/* $begin mhz */
-/* Get the clock rate from /proc */
-double mhz_full(int verbose, int sleeptime __attribute__((unused)))
+/* The TSC rate the kernel measured at boot, in MHz, or 0 */
+static double sysfs_mhz(void)
 {
-    double mhz = 2281.0;
+    FILE *f = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r");
+    double khz = 0;
 
-    if (verbose)
-	printf("Processor clock rate ~= %.1f MHz\n", mhz);
-    return mhz;
+    if (f) {
+	if (fscanf(f, "%lf", &khz) != 1)
+	    khz = 0;
+	fclose(f);
+    }
+    return khz / 1e3;
+}
+
+/* A measured clock rate is kept in this file, for this boot only */
+static void mhz_cache_path(char *path, size_t len)
+{
+    const char *home = getenv("HOME");
+
+    snprintf(path, len, "%s/.mdriver_mhz", home ? home : "/tmp");
+}
+
+static void boot_id(char *id, size_t len)
+{
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+    id[0] = 0;
+    if (f) {
+	if (fgets(id, len, f) == NULL)
+	    id[0] = 0;
+	id[strcspn(id, "\n")] = 0;
+	fclose(f);
+    }
+}
 
-#if 0
+/* The rate in the cache file, if it was measured since the last boot */
+static double cached_mhz(void)
+{
+    char path[1024], id[64], cached_id[64];
+    double rate = 0;
+    FILE *f;
+
+    boot_id(id, sizeof(id));
+    mhz_cache_path(path, sizeof(path));
+    if (id[0] == 0 || (f = fopen(path, "r")) == NULL)
+	return 0;
+    if (fscanf(f, "%63s %lf", cached_id, &rate) != 2 || strcmp(id, cached_id))
+	rate = 0;
+    fclose(f);
+    return rate;
+}
+
+static void save_mhz(double rate)
+{
+    char path[1024], id[64];
+    FILE *f;
+
+    boot_id(id, sizeof(id));
+    mhz_cache_path(path, sizeof(path));
+    if (id[0] == 0 || (f = fopen(path, "w")) == NULL)
+	return;
+    fprintf(f, "%s %.3f\n", id, rate);
+    fclose(f);
+}
+
+/* $begin mhz */
+/* Get the clock rate: from the processor or the kernel if they say,
+   else from the last measurement this boot, else by counting cycles
+   over sleeptime seconds (and keeping the result for next time) */
+double mhz_full(int verbose, int sleeptime)
+{
+    struct timeval t0, t1;
+    const char *how = "cpuid";
     double rate;
 
-    start_counter();
-    sleep(sleeptime);
-    rate = get_counter() / (1e6*sleeptime);
+    if ((rate = cpuid_mhz()) == 0) {
+	how = "sysfs";
+	rate = sysfs_mhz();
+    }
+    if (rate == 0) {
+	how = "cached";
+	rate = cached_mhz();
+    }
+    if (rate == 0) {
+	how = "measured";
+	gettimeofday(&t0, NULL);
+	start_counter();
+	sleep(sleeptime);
+	rate = get_counter();
+	gettimeofday(&t1, NULL);
+	rate /= (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec);
+	save_mhz(rate);
+    }
     if (verbose) 
-	printf("Processor clock rate ~= %.1f MHz\n", rate);
+	printf("Processor clock rate ~= %.1f MHz (%s)\n", rate, how);
     return rate;
-#endif
 }
 /* $end mhz */
 
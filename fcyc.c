@@ -8,6 +8,7 @@
  * the time in CPU cycles for a function f.
  */
 #include <stdlib.h>
+#include <string.h>
 #include <sys/times.h>
 #include <stdio.h>
 
@@ -22,6 +23,10 @@
 #define CLEAR_CACHE 0        /* Clear cache before running test function */
 #define CACHE_BYTES (1<<19)  /* Max cache size in bytes */
 #define CACHE_BLOCK 32       /* Cache block size in bytes */
+#define WARMUP 2             /* Runs thrown away by fcyc_median */
+#define RUNS 15              /* Runs measured by fcyc_median */
+#define NOISE 0.05           /* Widest half interval, relative to the median */
+#define RESAMPLES 1000       /* Bootstrap resamples */
 
 static int kbest = K;
 static int maxsamples = MAXSAMPLES;
@@ -30,6 +35,10 @@ static int compensate = COMPENSATE;
 static int clear_cache = CLEAR_CACHE;
 static int cache_bytes = CACHE_BYTES;
 static int cache_block = CACHE_BLOCK;
+static int warmup = WARMUP;
+static int runs = RUNS;
+static double noise = NOISE;
+static double (*sample_clock)(void) = NULL;
 
 static int *cache_buf = NULL;
 
@@ -113,6 +122,8 @@ static void clear()
 	    fprintf(stderr, "Fatal error.  Malloc returned null when trying to clear cache\n");
 	    exit(1);
 	}
+	/* back it with real pages: untouched, it is all the zero page */
+	memset(cache_buf, 1, cache_bytes);
     }
     cptr = (int *) cache_buf;
     cend = cptr + cache_bytes/sizeof(int);
@@ -123,6 +134,9 @@ static void clear()
     sink = x;
 }
 
+/* measure f once; defined below */
+static double measure(test_funct f, void *argp);
+
 /*
  * fcyc - Use K-best scheme to estimate the running time of function f
  */
@@ -130,7 +144,11 @@ double fcyc(test_funct f, void *argp)
 {
     double result;
     init_sampler();
-    if (compensate) {
+    if (sample_clock) {
+	do {
+	    add_sample(measure(f, argp));
+	} while (!has_converged() && samplecount < maxsamples);
+    } else if (compensate) {
 	do {
 	    double cyc;
 	    if (clear_cache)
@@ -167,6 +185,91 @@ double fcyc(test_funct f, void *argp)
     return result;  
 }
 
+/* 
+ * measure - Run f once, cache cleared and timer interrupts
+ *     compensated for as set up, and return the cycles (or the time
+ *     on sample_clock) it took
+ */
+static double measure(test_funct f, void *argp)
+{
+    double t;
+
+    if (clear_cache)
+	clear();
+    if (sample_clock) {
+	t = sample_clock();
+	f(argp);
+	return sample_clock() - t;
+    }
+    if (compensate) {
+	start_comp_counter();
+	f(argp);
+	return get_comp_counter();
+    }
+    start_counter();
+    f(argp);
+    return get_counter();
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* the median of n sorted values */
+static double median(const double *v, int n)
+{
+    return (n % 2) ? v[n/2] : (v[n/2 - 1] + v[n/2]) / 2;
+}
+
+/* 
+ * fcyc_median - Run f warmup times, then measure it runs times and
+ *     return the median. The confidence interval comes from resampling
+ *     the runs with replacement RESAMPLES times (a percentile bootstrap);
+ *     the random numbers are fixed, so the same runs give the same
+ *     interval.
+ */
+double fcyc_median(test_funct f, void *argp, fcyc_ci_t *ci)
+{
+    double *v, *r, *meds;
+    unsigned seed = 1;
+    int i, j;
+
+    v = malloc(runs * sizeof(double));
+    r = malloc(runs * sizeof(double));
+    meds = malloc(RESAMPLES * sizeof(double));
+    if (!v || !r || !meds) {
+	fprintf(stderr, "Fatal error.  Malloc returned null in fcyc_median\n");
+	exit(1);
+    }
+
+    for (i = 0; i < warmup; i++)
+	measure(f, argp);
+    for (i = 0; i < runs; i++)
+	v[i] = measure(f, argp);
+    qsort(v, runs, sizeof(double), cmp_double);
+    ci->median = median(v, runs);
+
+    for (j = 0; j < RESAMPLES; j++) {
+	for (i = 0; i < runs; i++) {
+	    seed = seed * 1103515245 + 12345;
+	    r[i] = v[(seed >> 16) % runs];
+	}
+	qsort(r, runs, sizeof(double), cmp_double);
+	meds[j] = median(r, runs);
+    }
+    qsort(meds, RESAMPLES, sizeof(double), cmp_double);
+    ci->lo = meds[RESAMPLES * 25 / 1000];
+    ci->hi = meds[RESAMPLES * 975 / 1000 - 1];
+    ci->noisy = ci->hi - ci->lo > 2 * noise * ci->median;
+
+    free(v);
+    free(r);
+    free(meds);
+    return ci->median;
+}
+
 
 /*************************************************************
  * Set the various parameters used by the measurement routines 
@@ -245,7 +348,40 @@ void set_fcyc_epsilon(double epsilon_arg)
     epsilon = epsilon_arg;
 }
 
+/* 
+ * set_fcyc_warmup - Runs of f to throw away before fcyc_median measures
+ *     Default = 2
+ */
+void set_fcyc_warmup(int warmup_arg)
+{
+    warmup = warmup_arg;
+}
 
+/* 
+ * set_fcyc_runs - Number of measured runs in fcyc_median
+ *     Default = 15
+ */
+void set_fcyc_runs(int runs_arg)
+{
+    runs = runs_arg > 0 ? runs_arg : 1;
+}
 
+/* 
+ * set_fcyc_noise - fcyc_median flags a result as noisy when its
+ *     confidence interval is wider than +/- this fraction of the median
+ *     Default = 0.05
+ */
+void set_fcyc_noise(double noise_arg)
+{
+    noise = noise_arg;
+}
 
-
+/* 
+ * set_fcyc_clock - Measure with this clock (returning a time in any
+ *     unit) instead of the cycle counter; NULL for the cycle counter.
+ *     Default = NULL
+ */
+void set_fcyc_clock(double (*clock_arg)(void))
+{
+    sample_clock = clock_arg;
+}
@@ -13,6 +13,17 @@ typedef void (*test_funct)(void *);
 /* Compute number of cycles used by test function f */
 double fcyc(test_funct f, void* argp);
 
+/* The median of a set of samples, with a bootstrap confidence interval */
+typedef struct {
+    double median;
+    double lo, hi;      /* 95% confidence interval of the median */
+    int noisy;          /* is the interval wider than the noise limit? */
+} fcyc_ci_t;
+
+/* Compute the median number of cycles used by f over a fixed number of
+   runs, after some warmup runs, and its confidence interval in *ci */
+double fcyc_median(test_funct f, void *argp, fcyc_ci_t *ci);
+
 /*********************************************************
  * Set the various parameters used by measurement routines 
  *********************************************************/
@@ -63,6 +74,28 @@ void set_fcyc_maxsamples(int maxsamples_arg);
  */
 void set_fcyc_epsilon(double epsilon_arg);
 
+/* 
+ * set_fcyc_warmup - Runs of f to throw away before fcyc_median measures
+ *     Default = 2
+ */
+void set_fcyc_warmup(int warmup_arg);
 
+/* 
+ * set_fcyc_runs - Number of measured runs in fcyc_median
+ *     Default = 15
+ */
+void set_fcyc_runs(int runs_arg);
 
+/* 
+ * set_fcyc_noise - fcyc_median flags a result as noisy when its
+ *     confidence interval is wider than +/- this fraction of the median
+ *     Default = 0.05
+ */
+void set_fcyc_noise(double noise_arg);
 
+/* 
+ * set_fcyc_clock - Measure with this clock (returning a time in any
+ *     unit) instead of the cycle counter; NULL for the cycle counter.
+ *     Default = NULL
+ */
+void set_fcyc_clock(double (*clock_arg)(void));
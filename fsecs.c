@@ -1,17 +1,172 @@
 /****************************
  * High-level timing wrappers
  ****************************/
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
 #include "fsecs.h"
 #include "fcyc.h"
 #include "clock.h"
 #include "ftimer.h"
 #include "config.h"
 
+/* The timing methods; config.h picks the default, set_fsecs_timer
+   another one at run time */
+enum { TIMER_FCYC, TIMER_ITIMER, TIMER_GETTOD, TIMER_CLOCK };
+
+static const char *timer_names[] = { "fcyc", "itimer", "gettod", "clock" };
+
+static int timer = USE_FCYC ? TIMER_FCYC : USE_ITIMER ? TIMER_ITIMER
+    : TIMER_GETTOD;
+static int pin_cpu = -1;    /* core to time on, or -1 for any */
+static cpu_set_t saved_cpus;
+static int pinned = 0;
+
+static int clear_cache = 1;     /* clear the caches before each run? */
+
+/* Never clear more than this, whatever the last-level cache says: some
+   virtual machines report the whole socket's cache, hundreds of MB */
+#define CLEAR_MAX (64 << 20)
+
 static double Mhz;  /* estimated CPU clock frequency */
 
 extern int verbose; /* -v option in mdriver.c */
 
+/*
+ * set_fsecs_timer - Choose the timing method by name; returns -1 if
+ *     there is no such method
+ */
+int set_fsecs_timer(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(timer_names) / sizeof(*timer_names)); i++)
+	if (!strcmp(name, timer_names[i])) {
+	    timer = i;
+	    return 0;
+	}
+    return -1;
+}
+
+/*
+ * set_fsecs_cpu - Time on this core (-1 for whichever one we are on
+ *     when init_fsecs runs, which is what the clock method does anyway)
+ */
+void set_fsecs_cpu(int cpu)
+{
+    pin_cpu = cpu;
+}
+
+/*
+ * set_fsecs_cache - Start each run with cold caches (clear = 1, the
+ *     default) or with whatever the last run left in them (0)
+ */
+void set_fsecs_cache(int clear)
+{
+    clear_cache = clear;
+}
+
+/*
+ * fsecs_cache_size - The size in bytes of the largest data (or unified)
+ *     cache of core 0, from sysfs, and its line size in *line; 0 if
+ *     sysfs doesn't say
+ */
+long fsecs_cache_size(int *line)
+{
+    char path[128], type[32];
+    long size, best = 0;
+    char unit;
+    FILE *f;
+    int i, n;
+
+    *line = 64;
+    for (i = 0; ; i++) {
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+	if ((f = fopen(path, "r")) == NULL)
+	    break;
+	n = fscanf(f, "%31s", type);
+	fclose(f);
+	if (n != 1 || !strcmp(type, "Instruction"))
+	    continue;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+	if ((f = fopen(path, "r")) == NULL)
+	    continue;
+	unit = 0;
+	n = fscanf(f, "%ld%c", &size, &unit);
+	fclose(f);
+	if (n < 1)
+	    continue;
+	size <<= unit == 'K' ? 10 : unit == 'M' ? 20 : unit == 'G' ? 30 : 0;
+	if (size <= best)
+	    continue;
+	best = size;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/"
+		 "index%d/coherency_line_size", i);
+	if ((f = fopen(path, "r")) != NULL) {
+	    if (fscanf(f, "%d", line) != 1 || *line <= 0)
+		*line = 64;
+	    fclose(f);
+	}
+    }
+    return best;
+}
+
+/*
+ * set_clear - Size fcyc's cache clearing to the last-level cache, so
+ *     that a cleared cache really is cold
+ */
+static void set_clear(void)
+{
+    long bytes;
+    int line;
+
+    set_fcyc_clear_cache(clear_cache);
+    if (!clear_cache) {
+	if (verbose)
+	    printf("Caches are left warm between runs.\n");
+	return;
+    }
+    if ((bytes = fsecs_cache_size(&line)) == 0)
+	return;             /* keep fcyc's default */
+    if (bytes > CLEAR_MAX)
+	bytes = CLEAR_MAX;
+    set_fcyc_cache_size(bytes);
+    set_fcyc_cache_block(line);
+    if (verbose)
+	printf("Clearing %ld KB of cache (%d-byte lines) before each run.\n",
+	       bytes >> 10, line);
+}
+
+/*
+ * fsecs_pin - Move the calling thread onto pin_cpu for the measurement,
+ *     so its samples are not split across cores; fsecs_unpin puts back
+ *     the cores it had. Threads made outside the measurement are not
+ *     tied down.
+ */
+void fsecs_pin(void)
+{
+    cpu_set_t set;
+
+    if (pin_cpu < 0 || sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus))
+	return;
+    CPU_ZERO(&set);
+    CPU_SET(pin_cpu, &set);
+    pinned = !sched_setaffinity(0, sizeof(set), &set);
+}
+
+void fsecs_unpin(void)
+{
+    if (pinned)
+	sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+    pinned = 0;
+}
+
 /*
  * init_fsecs - initialize the timing package
  */
@@ -19,24 +174,86 @@ void init_fsecs(void)
 {
     Mhz = 0; /* keep gcc -Wall happy */
 
-#if USE_FCYC
-    if (verbose)
-	printf("Measuring performance with a cycle counter.\n");
-
-    /* set key parameters for the fcyc package */
-    set_fcyc_maxsamples(20); 
-    set_fcyc_clear_cache(1);
-    set_fcyc_compensate(1);
-    set_fcyc_epsilon(0.01);
-    set_fcyc_k(3);
-    Mhz = mhz(verbose > 0);
-#elif USE_ITIMER
-    if (verbose)
-	printf("Measuring performance with the interval timer.\n");
-#elif USE_GETTOD
-    if (verbose)
-	printf("Measuring performance with gettimeofday().\n");
-#endif
+    switch (timer) {
+    case TIMER_FCYC:
+	if (verbose)
+	    printf("Measuring performance with a cycle counter.\n");
+
+	/* set key parameters for the fcyc package */
+	set_fcyc_maxsamples(20); 
+	set_clear();
+	set_fcyc_compensate(1);
+	set_fcyc_epsilon(0.01);
+	set_fcyc_k(3);
+	Mhz = mhz(verbose > 0);
+	break;
+
+    case TIMER_CLOCK:
+	/* the same K-best scheme, on nanoseconds of CLOCK_MONOTONIC_RAW
+	   (timer interrupts are in the samples; K-best drops them) */
+	if (pin_cpu < 0)
+	    pin_cpu = sched_getcpu();
+	if (verbose)
+	    printf("Measuring performance with clock_gettime() on core %d.\n",
+		   pin_cpu);
+	set_fcyc_maxsamples(20); 
+	set_clear();
+	set_fcyc_compensate(0);
+	set_fcyc_epsilon(0.01);
+	set_fcyc_k(3);
+	set_fcyc_clock(ftimer_clock_ns);
+	break;
+
+    case TIMER_ITIMER:
+	if (verbose)
+	    printf("Measuring performance with the interval timer.\n");
+	break;
+
+    case TIMER_GETTOD:
+	if (verbose)
+	    printf("Measuring performance with gettimeofday().\n");
+	break;
+    }
+}
+
+/*
+ * fsecs_mhz - Return the clock rate of the cycle counter, measuring it
+ *     now if the timing package does not use the counter
+ */
+double fsecs_mhz(void)
+{
+    if (Mhz == 0)
+	Mhz = mhz(0);
+    return Mhz;
+}
+
+/*
+ * fsecs_stamp - Read the timing method's clock, for timing one short
+ *     event at a time: the cycle counter for fcyc, and CLOCK_MONOTONIC_RAW
+ *     for the others, which have no clock of their own that fine (and
+ *     need no cycle counter). fsecs_tick is the length of a tick in
+ *     seconds and fsecs_tick_name its name.
+ */
+unsigned long long fsecs_stamp(void)
+{
+    return timer == TIMER_FCYC ? read_counter()
+	: (unsigned long long)ftimer_clock_ns();
+}
+
+double fsecs_tick(void)
+{
+    return timer == TIMER_FCYC ? 1/(fsecs_mhz()*1e6) : 1e-9;
+}
+
+const char *fsecs_tick_name(void)
+{
+    return timer == TIMER_FCYC ? "cycles" : "ns";
+}
+
+/* fcyc's units, in seconds */
+static double fcyc_secs(double t)
+{
+    return timer == TIMER_CLOCK ? t * 1e-9 : t/(Mhz*1e6);
 }
 
 /*
@@ -44,14 +261,54 @@ void init_fsecs(void)
  */
 double fsecs(fsecs_test_funct f, void *argp) 
 {
-#if USE_FCYC
-    double cycles = fcyc(f, argp);
-    return cycles/(Mhz*1e6);
-#elif USE_ITIMER
-    return ftimer_itimer(f, argp, 10);
-#elif USE_GETTOD
-    return ftimer_gettod(f, argp, 10);
-#endif 
+    double secs;
+
+    fsecs_pin();
+    switch (timer) {
+    case TIMER_FCYC:
+    case TIMER_CLOCK:
+	secs = fcyc_secs(fcyc(f, argp));
+	break;
+    case TIMER_ITIMER:
+	secs = ftimer_itimer(f, argp, 10);
+	break;
+    default:
+	secs = ftimer_gettod(f, argp, 10);
+	break;
+    }
+    fsecs_unpin();
+    return secs;
+}
+
+/*
+ * set_fsecs_runs - Set up the runs fsecs_median makes
+ */
+void set_fsecs_runs(int warmup, int runs, double noise)
+{
+    set_fcyc_warmup(warmup);
+    set_fcyc_runs(runs);
+    set_fcyc_noise(noise);
 }
 
+/*
+ * fsecs_median - Return the median running time of f (in seconds) and
+ *     its confidence interval. Only the cycle counter and clock methods
+ *     have one; the timers give a single estimate, for which lo = hi.
+ */
+double fsecs_median(fsecs_test_funct f, void *argp,
+		    double *lo, double *hi, int *noisy)
+{
+    fcyc_ci_t ci;
 
+    if (timer != TIMER_FCYC && timer != TIMER_CLOCK) {
+	*noisy = 0;
+	return *lo = *hi = fsecs(f, argp);
+    }
+    fsecs_pin();
+    fcyc_median(f, argp, &ci);
+    fsecs_unpin();
+    *lo = fcyc_secs(ci.lo);
+    *hi = fcyc_secs(ci.hi);
+    *noisy = ci.noisy;
+    return fcyc_secs(ci.median);
+}
@@ -1,4 +1,31 @@
 typedef void (*fsecs_test_funct)(void *);
 
 void init_fsecs(void);
+
+/* Choose the timing method at run time: fcyc, itimer, gettod or clock
+   (returns -1 for any other name), and the core to time on */
+int set_fsecs_timer(const char *name);
+void set_fsecs_cpu(int cpu);
+
+/* Clear the caches before each run (the default), or not; and the size
+   of the last-level cache and of its lines, from sysfs (0 if unknown) */
+void set_fsecs_cache(int clear);
+long fsecs_cache_size(int *line);
 double fsecs(fsecs_test_funct f, void *argp);
+double fsecs_mhz(void);
+
+/* Time on the chosen core until fsecs_unpin (fsecs does this itself) */
+void fsecs_pin(void);
+void fsecs_unpin(void);
+
+/* The timing method's clock, for timing one request at a time: a
+   reading, the seconds in one of its ticks, and their name */
+unsigned long long fsecs_stamp(void);
+double fsecs_tick(void);
+const char *fsecs_tick_name(void);
+
+/* The median running time of f over a fixed number of runs, with the
+   95% confidence interval in *lo, *hi and *noisy set if it is wide */
+void set_fsecs_runs(int warmup, int runs, double noise);
+double fsecs_median(fsecs_test_funct f, void *argp,
+		    double *lo, double *hi, int *noisy);
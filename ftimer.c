@@ -7,8 +7,10 @@
  * Function timers that estimate the running time (in seconds) of a function f.
  *    ftimer_itimer: version that uses the interval timer
  *    ftimer_gettod: version that uses gettimeofday
+ *    ftimer_clock_ns: a nanosecond clock for the fcyc package to sample
  */
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
 #include "ftimer.h"
 
@@ -52,6 +54,21 @@ double ftimer_gettod(ftimer_test_funct f, void *argp, int n)
     return (1E-3*diff);
 }
 
+/* 
+ * ftimer_clock_ns - The time in nanoseconds on CLOCK_MONOTONIC_RAW, or on
+ * CLOCK_MONOTONIC where the raw clock is missing
+ */
+double ftimer_clock_ns(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_RAW
+    if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) == 0)
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
 
 /*
  * Routines for manipulating the Unix interval timer
@@ -12,3 +12,7 @@ double ftimer_itimer(ftimer_test_funct f, void *argp, int n);
    Return the average of n runs */
 double ftimer_gettod(ftimer_test_funct f, void *argp, int n);
 
+
+/* The time in nanoseconds on CLOCK_MONOTONIC_RAW (a clock no one can
+   set or slew), for timing one run of a function at a time */
+double ftimer_clock_ns(void);
@@ -0,0 +1,103 @@
+/*
+ * latency.c - Log-linear histograms of event latencies
+ *
+ * Latencies below LAT_SUB ticks get a bucket each. Above that, every
+ * power of two [2^k, 2^(k+1)) is split into LAT_SUB equal buckets, so a
+ * bucket is never wider than 1/LAT_SUB of its lower bound: percentiles
+ * are good to about 6% whatever the scale, and a histogram is a fixed
+ * few kilobytes however many events go into it.
+ */
+#include <string.h>
+
+#include "latency.h"
+
+/* 
+ * bucket - the bucket that holds latency v
+ */
+static int bucket(unsigned long long v)
+{
+    int k;
+
+    if (v < LAT_SUB)
+        return (int)v;
+    k = 63 - __builtin_clzll(v);
+    return (k - LAT_SUB_BITS + 1) * LAT_SUB
+        + (int)((v >> (k - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+void lat_reset(lat_hist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void lat_add(lat_hist_t *h, unsigned long long ticks)
+{
+    h->count[bucket(ticks)]++;
+    h->n++;
+    h->sum += ticks;
+    if (ticks > h->max)
+        h->max = ticks;
+}
+
+unsigned long long lat_lower(int i)
+{
+    int k = i / LAT_SUB + LAT_SUB_BITS - 1;
+
+    if (i < LAT_SUB)
+        return i;
+    return (unsigned long long)(LAT_SUB + i % LAT_SUB) << (k - LAT_SUB_BITS);
+}
+
+unsigned long long lat_upper(int i)
+{
+    int k = i / LAT_SUB + LAT_SUB_BITS - 1;
+
+    if (i < LAT_SUB)
+        return i;
+    return lat_lower(i) + (1ULL << (k - LAT_SUB_BITS)) - 1;
+}
+
+/*
+ * lat_percentile - the upper bound of the bucket holding the event of
+ *     rank ceil(p * n), clipped to the largest latency seen
+ */
+unsigned long long lat_percentile(const lat_hist_t *h, double p)
+{
+    unsigned long long rank, sum = 0;
+    unsigned long long v;
+    int i;
+
+    if (h->n == 0)
+        return 0;
+    rank = (unsigned long long)(p * h->n);
+    if (rank < p * h->n)
+        rank++;
+    if (rank == 0)
+        rank = 1;
+    for (i = 0; i < LAT_NBUCKETS; i++) {
+        sum += h->count[i];
+        if (sum >= rank) {
+            v = lat_upper(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * lat_overhead - the fewest ticks seen between two back-to-back
+ *     reads of the clock
+ */
+unsigned long long lat_overhead(unsigned long long (*stamp)(void))
+{
+    unsigned long long t0, t1, best = ~0ULL;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        t0 = stamp();
+        t1 = stamp();
+        if (t1 - t0 < best)
+            best = t1 - t0;
+    }
+    return best;
+}
@@ -0,0 +1,33 @@
+/*
+ * latency.h - prototypes for the log-linear latency histograms in
+ *     latency.c, used by the driver's latency mode (-L)
+ */
+
+/* Each power of two of cycles is split into LAT_SUB linear buckets */
+#define LAT_SUB_BITS 4
+#define LAT_SUB      (1 << LAT_SUB_BITS)
+#define LAT_NBUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+/* A histogram of event latencies in clock ticks (cycles or ns) */
+typedef struct {
+    unsigned long long count[LAT_NBUCKETS];
+    unsigned long long n;      /* events recorded */
+    unsigned long long sum;    /* their total latency */
+    unsigned long long max;    /* largest latency seen */
+} lat_hist_t;
+
+/* Empty the histogram */
+void lat_reset(lat_hist_t *h);
+
+/* Record one event that took ticks ticks */
+void lat_add(lat_hist_t *h, unsigned long long ticks);
+
+/* Latency at or below which a fraction p (0..1) of the events fall */
+unsigned long long lat_percentile(const lat_hist_t *h, double p);
+
+/* Bounds of bucket i, in ticks */
+unsigned long long lat_lower(int i);
+unsigned long long lat_upper(int i);
+
+/* Cost of an empty pair of stamp calls, to subtract from each event */
+unsigned long long lat_overhead(unsigned long long (*stamp)(void));
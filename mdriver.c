@@ -8,6 +8,7 @@
  * May not be used, modified, or copied without permission.
  */
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <float.h>
 #include <setjmp.h>
@@ -18,13 +19,25 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
 #include "config.h"
 #include "driverlib.h"
+#include "perfctr.h"
+#include "mtbench.h"
+#include "mmtest.h"
+#include "latency.h"
+#include "repb.h"
 
 /**********************
  * Constants and macros
@@ -38,6 +51,13 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* The i-th request of a trace; a streamed trace moves on a window */
+#define TRACE_OP(trace, i) ((i) - (trace)->op_base < (trace)->op_count \
+		? &(trace)->ops[(i) - (trace)->op_base] : next_window(trace, i))
+
+/* The lifetime hint to replay an op with (-I ignores them) */
+#define OP_HINT(op) (ignore_hints ? MM_HINT_NONE : (op)->hint)
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -52,34 +72,98 @@
  * Remember that index (-1) is the null pointer.
  */
 
-/* Records the extent of each block's payload */
+/*
+ * Records the extent of each block's payload. The ranges are kept in a
+ * treap (a search tree on lo, heap-ordered on a random priority) so that
+ * finding a range, and checking a new one for overlap, is O(log n).
+ */
 typedef struct range_t {
 	char *lo;              /* low payload address */
 	char *hi;              /* high payload address */
-	struct range_t *next;  /* next list element */
+	struct range_t *left;  /* ranges with lower lo; free list link in the pool */
+	struct range_t *right; /* ranges with higher lo */
+	unsigned prio;         /* treap priority */
 	int index;             /* same index as free; for debugging */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-	enum { ALLOC, FREE, REALLOC } type; /* type of request */
-	int index;                        /* index for free() to use later */
-	size_t size;                      /* byte size of alloc/realloc request */
-} traceop_t;
+/* Range records are carved out of chunks of this many */
+#define RANGE_CHUNK 1024
+
+/* With DBG_EXPENSIVE, check the whole heap once every this many requests */
+#define FULL_CHECK_PERIOD 1000
+
+/* In the util pass, sample the free space every this many requests */
+#define FRAG_PERIOD 1000
+
+/* The cache states the timed runs can start from (-x) */
+enum { CACHE_COLD, CACHE_WARM, CACHE_NOISE };
+
+/* The noise of -x noise cycles through at most this many bytes */
+#define NOISE_MAX (64 << 20)
+
+/* With -T, the threaded replay of a trace is timed this many times */
+#define THREAD_RUNS 3
+
+/* A streamed trace is read in windows of this many requests */
+#define STREAM_WINDOW 65536
+
+struct stream_t;
 
 /* Holds the information for one trace file*/
 typedef struct {
 	char filename[MAXLINE];
-	int ignore_ranges;   /* don't check ranges (i.e. this is too big) */
+	int ignore_ranges;   /* unused: the range tree is cheap enough for any trace */
 	int num_ids;         /* number of alloc/realloc ids */
 	int num_ops;         /* number of distinct requests */
 	int weight;          /* weight for this trace (unused) */
-	traceop_t *ops;      /* array of requests */
+	traceop_t *ops;      /* array of requests... */
+	int op_base;         /* ... the first of which is request op_base... */
+	int op_count;        /* ... out of this many in the array */
+	void *map;           /* mapping of a binary trace, which holds ops */
+	size_t map_len;
+	struct stream_t *stream; /* set if the trace is streamed (-S) */
+	int num_slots;       /* length of the three arrays below */
 	char **blocks;       /* array of ptrs returned by malloc/realloc... */
 	size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 	int *block_rand_base;/* index into random_data, if debug is on */
 } trace_t;
 
+/*
+ * A streamed trace (-S) is never held in memory. A reader thread parses
+ * it one window at a time, one window ahead of the replay. The reader
+ * also renames block ids to slots, and a freed id's slot goes to the
+ * next alloc. So the block arrays only grow to the peak number of live
+ * blocks, not to the number of ids in the trace.
+ */
+typedef struct {
+	traceop_t *ops;
+	int count;           /* requests in ops; 0 at the end of the trace */
+	int num_slots;       /* slots in use once these requests are read */
+} window_t;
+
+typedef struct stream_t {
+	FILE *file;
+	long start;          /* file offset of the first request */
+	int binary;          /* the requests are traceop_t records */
+	const char *filename;
+
+	pthread_t reader;
+	int running;         /* the reader thread has been started */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	window_t win[2];     /* replayed by turns... */
+	int filled[2];       /* ... once the reader has filled them */
+	int cur;             /* the window being replayed, or -1 */
+	int stop;            /* tells the reader to quit */
+
+	/* the reader's id to slot map: an open-addressing hash table */
+	int *ids, *slots;
+	int map_size, map_used;
+	int *free_slots;     /* stack of slots of freed ids */
+	int num_free, free_size;
+	int num_slots;
+} stream_t;
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -100,13 +184,47 @@ typedef struct {
 	/* run-time stats defined for both libc and student */
 	int valid;       /* was the trace processed correctly by the allocator? */
 	double secs;     /* number of secs needed to run the trace */
+	double secs_lo;  /* with -R, the 95% confidence interval of secs, */
+	double secs_hi;  /* else both are secs */
+	int noisy;       /* with -R, is that interval too wide to trust? */
+	int noise_over;  /* with -x noise, the noise alone took as long as
+	                    the replay, so secs is unknown (and left out) */
 
 	/* defined only for the student malloc package */
 	double util;     /* space utilization for this trace (always 0 for libc) */
+	double frag;     /* peak external fragmentation in the util pass */
+
+	/* page faults and TLB misses in a plain replay of the trace on a
+	   heap with no pages mapped yet (-M) */
+	perfctr_t memctr;
+
+	/* all the events in one more run of the timed replay (-E) */
+	perfctr_t speedctr;
+
+	/* each request type (ALLOC, FREE, REALLOC) on its own: how many
+	   there are and their total time, timed one request at a time in
+	   a run of eval_requests of its own (-O); and the bytes realloc
+	   has to keep */
+	double op_count[3];
+	double op_secs[3];
+	double realloc_bytes;
 
 	/* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+/*
+ * With -P, worker processes take traces in turn from this record, which
+ * is shared with the driver, and leave their stats in it
+ */
+typedef struct {
+	int next;            /* next trace for a worker to take */
+	int errors;          /* errors found by all workers */
+	struct {
+		int done;        /* set once the stats below are in */
+		stats_t stats;
+	} result[];
+} par_state_t;
+
 
 /********************
  * For debugging.  If debug-mode is on, then we have each block start
@@ -135,6 +253,39 @@ int onetime_flag = 0;
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+static int use_hugepages = 0;   /* back the mm heap with huge pages (-H) */
+static int report_memctr = 0;   /* report page faults and TLB misses (-M) */
+static int report_speedctr = 0; /* report CPU events per request (-E) */
+static int robust_runs = 0;     /* time by the median of this many runs (-R) */
+static int warmup_runs = 2;     /* after this many unmeasured ones (-W) */
+static double noise_limit = 5;  /* flag intervals wider than this % (-Q) */
+static int cache_mode = CACHE_COLD; /* cache state the timed runs see (-x) */
+static int noise_bytes = 4096;  /* bytes the noise touches per request (-n) */
+static char *noise_buf = NULL;  /* the noise's working set, in CACHE_NOISE */
+static size_t noise_len = 0;
+static size_t noise_pos = 0;    /* where it has got to */
+static int noise_line = 64;
+static int touch_payloads = 0;  /* write and read back every payload (-w) */
+static int reread_period = 0;   /* and read all live ones this often (-r) */
+static volatile unsigned touch_sink; /* keeps the reads from going away */
+static int ignore_hints = 0;    /* ignore lifetime hints in traces (-I) */
+static int check_period = FULL_CHECK_PERIOD; /* full heap check period (-K) */
+static char *convert_file = NULL; /* write the trace here in binary and exit (-B) */
+static int stream_traces = 0;   /* stream traces instead of loading them (-S) */
+static int use_cache = 0;       /* keep parsed copies of text traces (-C) */
+static int par_jobs = 1;        /* worker processes for the checks (-P) */
+static int thread_replay = 0;   /* also replay traces on their threads (-T) */
+static char *bench_name = NULL; /* run this benchmark instead of traces (-b) */
+static int run_mmtest = 0;      /* run the interface checks instead (-X) */
+static int bench_threads = 4;   /* on up to this many threads (-N) */
+static int report_requests = 0; /* time each request type on its own (-O) */
+static int report_latency = 0;  /* print per-request latency percentiles (-L) */
+static FILE *latency_dump = NULL; /* and write the histograms here (-G) */
+static FILE *frag_file = NULL;  /* write the fragmentation timeline here (-F) */
+static int frag_period = FRAG_PERIOD; /* requests between its samples (-k) */
+static pid_t *workers = NULL;   /* their pids, while they run */
+static int num_workers = 0;
+
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -151,11 +302,14 @@ char autoresult[SUBMITR_MAXBUF]; /* autoresult string */
  * Function prototypes
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size,
 		const trace_t *trace, int opnum, int index);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static void check_ranges(const trace_t *trace, int opnum, range_t *r);
+static void check_neighbors(const trace_t *trace, int opnum, range_t *r,
+		char *lo);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
@@ -166,6 +320,24 @@ static void randomize_block(trace_t *trace, int index);
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		const char *filename);
 static trace_t *read_trace_stdin(stats_t *stats);
+static void read_trace_file(trace_t *trace, FILE *tracefile);
+static int read_op(FILE *tracefile, const char *filename, traceop_t *op);
+static int read_hint(const char *rest, const char *filename);
+static int read_thread(const char *rest, const char *filename);
+static trace_t *map_trace(trace_t *trace, stats_t *stats, const char *path);
+static int write_trace(const trace_t *trace, const char *filename,
+		long long mtime);
+static int cache_fresh(const char *cache, long long mtime);
+static trace_t *load_trace(trace_t **traces, int i, char trace_from_stdin,
+		const char *tracedir, char **tracefiles, stats_t *stats);
+static void eval_parallel(int num_tracefiles, const char *tracedir,
+		char **tracefiles, trace_t **traces, stats_t *mm_stats,
+		range_t *ranges);
+static void stop_workers(void);
+static void open_stream(trace_t *trace, FILE *file, int binary);
+static void restart_stream(trace_t *trace);
+static void close_stream(trace_t *trace);
+static traceop_t *next_window(trace_t *trace, int opnum);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -176,12 +348,25 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, double *frag);
 static void eval_mm_speed(void *ptr);
+static void eval_threads(trace_t *trace, int use_libc);
+static void eval_requests(trace_t *trace, int use_libc, stats_t *stats);
+static double eval_secs(fsecs_test_funct f, speed_t *params, stats_t *stats);
+static void eval_memctr(fsecs_test_funct f, speed_t *params, stats_t *stats,
+		int use_libc);
+static void eval_speedctr(fsecs_test_funct f, speed_t *params, stats_t *stats);
+static void init_noise(void);
+static void pollute(void);
+static void eval_noise_speed(void *ptr);
+static void touch_before(trace_t *trace, const traceop_t *op);
+static void touch_after(trace_t *trace, int opnum, const traceop_t *op);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static double thru_index(double throughput);
 static void usage(void);
+static void init_heap(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 	__attribute__((format(printf, 3,4)));
 static void unix_error(const char *fmt, ...)
@@ -199,10 +384,24 @@ static void app_error(const char *fmt, ...)
 /* Run the tests; return the number of tests run (may be less than
    num_tracefiles, if there's a timeout) */
 static void run_tests(int num_tracefiles, char trace_from_stdin,
-		const char *tracedir, char **tracefiles, 
+		const char *tracedir, char **tracefiles, trace_t **traces,
 		stats_t *mm_stats, range_t *ranges, speed_t *speed_params) {
 	volatile int i;
 	volatile int timed_out = 0;
+	volatile int parallel = par_jobs > 1 && num_tracefiles > 1 && !onetime_flag
+		&& frag_file == NULL;   /* one writer for the timeline */
+
+	/* With -P, check all the traces at once first; only the timing,
+	   below, is left to run one trace at a time */
+	if (parallel) {
+		if(setjmp(timeout_jmpbuf) != 0) {
+			stop_workers();
+			timed_out = 1;
+		} else {
+			eval_parallel(num_tracefiles, tracedir, tracefiles, traces,
+					mm_stats, ranges);
+		}
+	}
 
 	for (i=0; i < num_tracefiles; i++) {
 		/* handle timeouts */
@@ -211,38 +410,140 @@ static void run_tests(int num_tracefiles, char trace_from_stdin,
 		}
 
 		trace_t *trace;
-		trace = trace_from_stdin
-				? read_trace_stdin(&mm_stats[i])
-				: read_trace(&mm_stats[i], tracedir, tracefiles[i]);
+		trace = load_trace(traces, i, trace_from_stdin, tracedir,
+				tracefiles, &mm_stats[i]);
 
 		strcpy(mm_stats[i].filename, trace->filename);
 		mm_stats[i].ops = trace->num_ops;
 		if(timed_out) {
 			mm_stats[i].valid = 0;
-		} else {
+		} else if (!parallel) {
 			if (verbose > 1)
 				printf("Checking mm_malloc for correctness, ");
 			mm_stats[i].valid = eval_mm_valid(trace, &ranges);
 
-			if (onetime_flag) {
-				free_trace(trace);
+			if (onetime_flag)
 				return;
-			}
 		}
 		if (mm_stats[i].valid) {
-			if (verbose > 1)
-				printf("efficiency, ");
-			mm_stats[i].util = eval_mm_util(trace, i);
+			if (!parallel) {
+				if (verbose > 1)
+					printf("efficiency, ");
+				mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i].frag);
+			}
 			speed_params->trace = trace;
 			speed_params->ranges = ranges;
+			if (report_memctr)
+				eval_memctr(eval_mm_speed, speed_params, &mm_stats[i], 0);
 			if (verbose > 1)
 				printf("and performance.\n");
-			mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+			mm_stats[i].secs = eval_secs(eval_mm_speed, speed_params, &mm_stats[i]);
+			if (report_speedctr)
+				eval_speedctr(eval_mm_speed, speed_params, &mm_stats[i]);
+			if (thread_replay)
+				eval_threads(trace, 0);
+			if (report_requests)
+				eval_requests(trace, 0, &mm_stats[i]);
 		}
-		free_trace(trace);
 	}
 }
 
+/*
+ * eval_parallel - check the traces for correctness and utilization in
+ *     par_jobs worker processes. Each worker has its own copy of the
+ *     driver and of the (privately mapped) memlib heap, so the workers
+ *     run the mm package independently. The traces are parsed here,
+ *     before the workers start, so that they inherit them copy-on-write
+ *     and the timing afterwards uses the same copies. The stats come back
+ *     through a shared mapping; traces whose worker died are marked invalid.
+ */
+static void eval_parallel(int num_tracefiles, const char *tracedir,
+		char **tracefiles, trace_t **traces, stats_t *mm_stats,
+		range_t *ranges)
+{
+	par_state_t *state;
+	size_t len;
+	trace_t *trace;
+	stats_t *stats;
+	int i, w;
+
+	len = sizeof(*state) + num_tracefiles * sizeof(state->result[0]);
+	state = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (state == MAP_FAILED)
+		unix_error("mmap failed in eval_parallel");
+	memset(state, 0, len);
+
+	num_workers = par_jobs < num_tracefiles ? par_jobs : num_tracefiles;
+	if ((workers = calloc(num_workers, sizeof(*workers))) == NULL)
+		unix_error("calloc failed in eval_parallel");
+	if (verbose > 1)
+		printf("Checking mm_malloc in %d processes\n", num_workers);
+
+	/* a streamed trace is read on every replay anyway: each worker
+	   streams its own */
+	if (!stream_traces)
+		for (i = 0; i < num_tracefiles; i++)
+			load_trace(traces, i, 0, tracedir, tracefiles, &mm_stats[i]);
+
+	for (w = 0; w < num_workers; w++) {
+		if ((workers[w] = fork()) < 0)
+			unix_error("fork failed in eval_parallel");
+		if (workers[w] > 0)
+			continue;
+
+		/* the worker: the driver's timeout is not ours */
+		signal(SIGALRM, SIG_DFL);
+		while ((i = __sync_fetch_and_add(&state->next, 1)) < num_tracefiles) {
+			stats = &state->result[i].stats;
+			trace = load_trace(traces, i, 0, tracedir, tracefiles, stats);
+			stats->valid = eval_mm_valid(trace, &ranges);
+			if (stats->valid)
+				stats->util = eval_mm_util(trace, i, &stats->frag);
+			state->result[i].done = 1;
+		}
+		__sync_fetch_and_add(&state->errors, errors);
+		_exit(0);
+	}
+
+	for (w = 0; w < num_workers; w++)
+		while (waitpid(workers[w], NULL, 0) < 0 && errno == EINTR)
+			;
+	free(workers);
+	workers = NULL;
+	num_workers = 0;
+
+	errors += state->errors;
+	for (i = 0; i < num_tracefiles; i++) {
+		if (state->result[i].done) {
+			mm_stats[i] = state->result[i].stats;
+			continue;
+		}
+		load_trace(traces, i, 0, tracedir, tracefiles, &mm_stats[i]);
+		mm_stats[i].valid = 0;
+		errors++;
+		printf("ERROR [trace %s]: the worker checking this trace died\n",
+				mm_stats[i].filename);
+	}
+	munmap(state, len);
+}
+
+/*
+ * stop_workers - kill and reap the workers of eval_parallel (on a timeout)
+ */
+static void stop_workers(void)
+{
+	int w;
+
+	for (w = 0; w < num_workers; w++) {
+		kill(workers[w], SIGKILL);
+		waitpid(workers[w], NULL, 0);
+	}
+	free(workers);
+	workers = NULL;
+	num_workers = 0;
+}
+
 /**************
  * Main routine
  **************/
@@ -255,6 +556,7 @@ int main(int argc, char **argv)
 	int num_tracefiles = 0;    /* the number of traces in that array */
 
 	range_t *ranges = NULL;    /* keeps track of block extents for one trace */
+	trace_t **traces = NULL;   /* each trace, once read, for every pass */
 	stats_t *libc_stats = NULL;/* libc stats for each trace */
 	stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
 	speed_t speed_params;      /* input parameters to the xx_speed routines */
@@ -264,6 +566,8 @@ int main(int argc, char **argv)
 
 	/* temporaries used to compute the performance index */
 	double secs, ops, util, avg_mm_util, avg_mm_throughput = 0, p1, p2, perfindex;
+	double secs_lo, secs_hi;
+	int noisy, noise_over;
 	double weight = 0;
 	int numcorrect;
 
@@ -278,7 +582,7 @@ int main(int argc, char **argv)
 		num_tracefiles = 1;
 		trace_from_stdin = 1;
 #else
-	while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlDj")) != EOF) {
+	while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlDjHMEIK:B:SCP:Tb:N:OLG:F:k:R:W:Q:m:p:x:n:wr:X")) != EOF) {
 		switch (c) {
 
 			case 'A': /* Hidden Autolab driver argument */
@@ -332,10 +636,145 @@ int main(int argc, char **argv)
 				debug_mode = DBG_EXPENSIVE;
 				break;
 
+			case 'K': /* Full heap check period for -D */
+				check_period = atoi(optarg);
+				if (check_period < 1)
+					check_period = 1;
+				break;
+
 			case 's':
 				set_timeout = atoi(optarg);
 				break;
 
+			case 'H': /* Back the heap with huge pages */
+				use_hugepages = 1;
+				break;
+
+			case 'M': /* Report page faults and TLB misses */
+				report_memctr = 1;
+				break;
+
+			case 'E': /* Report CPU events per request */
+				report_speedctr = 1;
+				break;
+
+			case 'I': /* Ignore lifetime hints in the traces */
+				ignore_hints = 1;
+				break;
+
+			case 'B': /* Convert the trace to binary */
+				convert_file = strdup(optarg);
+				break;
+
+			case 'C': /* Cache parsed text traces */
+				use_cache = 1;
+				break;
+
+			case 'P': /* Check traces in parallel */
+				par_jobs = atoi(optarg);
+				break;
+
+			case 'T': /* Replay traces on their own threads too */
+				thread_replay = 1;
+				break;
+
+			case 'b': /* Run a synthetic benchmark */
+				bench_name = strdup(optarg);
+				break;
+
+			case 'N': /* Threads for the benchmarks */
+				bench_threads = atoi(optarg);
+				if (bench_threads < 1)
+					bench_threads = 1;
+				break;
+
+			case 'O': /* Break the time down by request type */
+				report_requests = 1;
+				break;
+
+			case 'L': /* Report request latencies */
+				report_requests = 1;
+				report_latency = 1;
+				break;
+
+			case 'G': /* Dump the latency histograms */
+				report_requests = 1;
+				report_latency = 1;
+				if ((latency_dump = fopen(optarg, "w")) == NULL)
+					unix_error("Could not open %s", optarg);
+				fprintf(latency_dump, "package,trace,op,lower,upper,count\n");
+				break;
+
+			case 'F': /* Write the fragmentation timeline */
+				if ((frag_file = fopen(optarg, "w")) == NULL)
+					unix_error("Could not open %s", optarg);
+				fprintf(frag_file, "trace,op,live,heap,free,largest_free,"
+						"free_blocks\n");
+				break;
+
+			case 'k': /* Requests between fragmentation samples */
+				frag_period = atoi(optarg);
+				if (frag_period < 1)
+					frag_period = 1;
+				break;
+
+			case 'm': /* Timing method */
+				if (set_fsecs_timer(optarg) < 0)
+					app_error("unknown timing method %s (fcyc, itimer, "
+							"gettod or clock)", optarg);
+				break;
+
+			case 'p': /* Core to time on */
+				set_fsecs_cpu(atoi(optarg));
+				break;
+
+			case 'x': /* Cache state for the timed runs */
+				if (!strcmp(optarg, "cold"))
+					cache_mode = CACHE_COLD;
+				else if (!strcmp(optarg, "warm"))
+					cache_mode = CACHE_WARM;
+				else if (!strcmp(optarg, "noise"))
+					cache_mode = CACHE_NOISE;
+				else
+					app_error("unknown cache mode %s (cold, warm or noise)",
+							optarg);
+				break;
+
+			case 'n': /* Bytes of noise per request */
+				noise_bytes = atoi(optarg);
+				break;
+
+			case 'w': /* Touch the payloads in the timed replay */
+				touch_payloads = 1;
+				report_speedctr = 1;
+				break;
+
+			case 'r': /* Re-read the live payloads periodically */
+				reread_period = atoi(optarg);
+				touch_payloads = 1;
+				report_speedctr = 1;
+				break;
+
+			case 'R': /* Time by the median of a number of runs */
+				robust_runs = atoi(optarg);
+				break;
+
+			case 'W': /* Warmup runs before those */
+				warmup_runs = atoi(optarg);
+				break;
+
+			case 'Q': /* Widest confidence interval to trust, in % */
+				noise_limit = atof(optarg);
+				break;
+
+			case 'S': /* Stream the traces */
+				stream_traces = 1;
+				break;
+
+			case 'X': /* Check the interfaces the traces don't use */
+				run_mmtest = 1;
+				break;
+
 			case 'j': /* For OJ */
 				num_tracefiles = 1;
 				trace_from_stdin = 1;
@@ -352,6 +791,42 @@ int main(int argc, char **argv)
 	}
 #endif
 
+	/* Convert one trace to the binary format and stop */
+	if (convert_file) {
+		stats_t stats;
+		trace_t *trace;
+
+		if (!trace_from_stdin && tracefiles == NULL)
+			app_error("-B needs a trace from -f, -c or -j");
+		stream_traces = 0;
+		trace = trace_from_stdin
+			? read_trace_stdin(&stats)
+			: read_trace(&stats, tracedir, tracefiles[0]);
+		if (write_trace(trace, convert_file, 0) < 0)
+			unix_error("Could not write %s", convert_file);
+		free_trace(trace);
+		exit(0);
+	}
+
+	/* Run the synthetic benchmarks instead of any traces */
+	if (bench_name) {
+		int bench = mtbench_lookup(bench_name);
+
+		if (bench < 0)
+			app_error("unknown benchmark %s (larson, threadtest, xmalloc "
+					"or all)", bench_name);
+		init_heap();
+		if (run_libc)
+			mtbench_run(bench, bench_threads, 1);
+		mtbench_run(bench, bench_threads, 0);
+		exit(0);
+	}
+
+	/* Check the persistent heap, region, pool and heap check interfaces
+	   instead of running traces; each check maps a heap of its own */
+	if (run_mmtest)
+		exit(mmtest_run() ? 1 : 0);
+
 	if (trace_from_stdin) {
 		printf("Using stdin as tracefile\n");
 	}
@@ -361,12 +836,24 @@ int main(int argc, char **argv)
 		printf("Using default tracefiles in %s\n", tracedir);
 	}
 
+	if ((traces = calloc(num_tracefiles, sizeof(*traces))) == NULL)
+		unix_error("traces calloc in main failed");
+
 	if(debug_mode != DBG_NONE) {
 		init_random_data();
 	}
 
 	/* Initialize the timing package */
+	set_fsecs_cache(cache_mode == CACHE_COLD);
 	init_fsecs();
+	if (cache_mode == CACHE_NOISE)
+		init_noise();
+	if (robust_runs > 0)
+		set_fsecs_runs(warmup_runs, robust_runs, noise_limit / 100);
+
+	if ((report_memctr || report_speedctr) && perfctr_init() < PC_NEVENTS
+			&& verbose)
+		printf("Some event counters are unavailable on this system.\n");
 
 	/* Initialize the timeout */
 	if (set_timeout) {
@@ -389,20 +876,29 @@ int main(int argc, char **argv)
 		/* Evaluate the libc malloc package using the K-best scheme */
 		for (i=0; i < num_tracefiles; i++) {
 			trace_t *trace;
-			trace = trace_from_stdin
-				? read_trace_stdin(&libc_stats[i])
-				: read_trace(&libc_stats[i], tracedir, tracefiles[i]);
+			trace = load_trace(traces, i, trace_from_stdin, tracedir,
+					tracefiles, &libc_stats[i]);
 
 			if (verbose > 1)
 				printf("Checking libc malloc for correctness, ");
 			libc_stats[i].valid = eval_libc_valid(trace);
 			if (libc_stats[i].valid) {
 				speed_params.trace = trace;
+				if (report_memctr)
+					eval_memctr(eval_libc_speed, &speed_params,
+							&libc_stats[i], 1);
 				if (verbose > 1)
 					printf("and performance.\n");
-				libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+				libc_stats[i].secs = eval_secs(eval_libc_speed, &speed_params,
+						&libc_stats[i]);
+				if (report_speedctr)
+					eval_speedctr(eval_libc_speed, &speed_params,
+							&libc_stats[i]);
+				if (thread_replay)
+					eval_threads(trace, 1);
+				if (report_requests)
+					eval_requests(trace, 1, &libc_stats[i]);
 			}
-			free_trace(trace);
 		}
 
 		/* Display the libc results in a compact table */
@@ -424,10 +920,10 @@ int main(int argc, char **argv)
 		unix_error("mm_stats calloc in main failed");
 
 	/* Initialize the simulated memory system in memlib.c */
-	mem_init();
+	init_heap();
 
 	run_tests(num_tracefiles, trace_from_stdin, tracedir, tracefiles,
-			mm_stats, ranges, &speed_params);
+			traces, mm_stats, ranges, &speed_params);
 
 
 	/* Display the mm results in a compact table */
@@ -450,12 +946,23 @@ int main(int argc, char **argv)
 	 * Accumulate the aggregate statistics for the student's mm package
 	 */
 	secs = 0;
+	secs_lo = secs_hi = 0;
+	noisy = 0;
 	ops = 0;
 	util = 0;
 	numcorrect = 0;
+	noise_over = 0;
 	for (i=0; i < num_tracefiles; i++) {
-		secs += mm_stats[i].secs * mm_stats[i].weight;
-		ops += mm_stats[i].ops * mm_stats[i].weight;
+		if (mm_stats[i].noise_over) {
+			/* the throughput is of the traces whose time is known */
+			noise_over += mm_stats[i].valid;
+		} else {
+			secs += mm_stats[i].secs * mm_stats[i].weight;
+			secs_lo += mm_stats[i].secs_lo * mm_stats[i].weight;
+			secs_hi += mm_stats[i].secs_hi * mm_stats[i].weight;
+			ops += mm_stats[i].ops * mm_stats[i].weight;
+		}
+		noisy += mm_stats[i].valid && mm_stats[i].noisy;
 		util += mm_stats[i].util * mm_stats[i].weight;
 		weight += mm_stats[i].weight;
 		if (mm_stats[i].valid)
@@ -484,13 +991,11 @@ int main(int argc, char **argv)
 			p1 = (avg_mm_util - MIN_SPACE) / (MAX_SPACE - MIN_SPACE) * UTIL_WEIGHT;
 		}
 
-		if (avg_mm_throughput < MIN_SPEED) {
-			p2 = 0.0;
-		} else if (avg_mm_throughput > MAX_SPEED) {
-			p2 = 1.0 - UTIL_WEIGHT;
-		} else {
-			p2 = (avg_mm_throughput - MIN_SPEED) / (MAX_SPEED - MIN_SPEED) * (1.0 - UTIL_WEIGHT);
-		}
+		p2 = thru_index(avg_mm_throughput);
+		if (noise_over)
+			printf("Warning: the noise alone took as long as the replay "
+					"of %d trace%s, left out of the throughput\n",
+					noise_over, noise_over == 1 ? "" : "s");
 
 		perfindex = (p1 + p2)*100.0;
 		printf("Perf index = %.6f (util) + %.6f (thru) = %.6f\n",
@@ -498,6 +1003,13 @@ int main(int argc, char **argv)
 				p2*100,
 				perfindex);
 
+		/* With -R, the interval of the index from those of the times */
+		if (robust_runs > 0 && weight != 0 && secs_lo > 0 && secs_hi > 0)
+			printf("Perf index 95%% interval = [%.6f, %.6f], %d noisy trace%s\n",
+					(p1 + thru_index(ops/secs_hi))*100,
+					(p1 + thru_index(ops/secs_lo))*100,
+					noisy, noisy == 1 ? "" : "s");
+
 	}
 	else { /* There were errors */
 		perfindex = 0.0;
@@ -515,21 +1027,151 @@ int main(int argc, char **argv)
 			avg_mm_throughput/1000.0, avg_mm_util*100);
 	driver_post(NULL, autoresult, autograder, status_msg);
 
+	for (i=0; i < num_tracefiles; i++)
+		if (traces[i])
+			free_trace(traces[i]);
+	free(traces);
+	if (latency_dump)
+		fclose(latency_dump);
+	if (frag_file)
+		fclose(frag_file);
 	exit(0);
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range tree, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.
  ****************************************************************/
 
+static range_t *range_pool = NULL;  /* unused range records */
+static unsigned range_seed = 1;     /* state of the priority generator */
+
+/*
+ * new_range - take a range record from the pool, refilling it with a
+ *     chunk of RANGE_CHUNK records from libc when it runs dry
+ */
+static range_t *new_range(void)
+{
+	range_t *p;
+	int i;
+
+	if (range_pool == NULL) {
+		if ((p = (range_t *)malloc(RANGE_CHUNK * sizeof(range_t))) == NULL)
+			unix_error("malloc error in new_range");
+		for (i = 0; i < RANGE_CHUNK; i++) {
+			p[i].left = range_pool;
+			range_pool = &p[i];
+		}
+	}
+	p = range_pool;
+	range_pool = p->left;
+
+	/* xorshift, so that we leave random() alone */
+	range_seed ^= range_seed << 13;
+	range_seed ^= range_seed >> 17;
+	range_seed ^= range_seed << 5;
+	p->prio = range_seed;
+	return p;
+}
+
+/*
+ * put_range - return a range record to the pool
+ */
+static void put_range(range_t *p)
+{
+	p->left = range_pool;
+	range_pool = p;
+}
+
+/*
+ * insert_range - insert record n into the treap t, returning the new root
+ */
+static range_t *insert_range(range_t *t, range_t *n)
+{
+	range_t *c;
+
+	if (t == NULL)
+		return n;
+	if (n->lo < t->lo) {
+		t->left = insert_range(t->left, n);
+		if (t->left->prio > t->prio) {  /* rotate right */
+			c = t->left;
+			t->left = c->right;
+			c->right = t;
+			t = c;
+		}
+	} else {
+		t->right = insert_range(t->right, n);
+		if (t->right->prio > t->prio) { /* rotate left */
+			c = t->right;
+			t->right = c->left;
+			c->left = t;
+			t = c;
+		}
+	}
+	return t;
+}
+
+/*
+ * join_ranges - join two treaps, all of whose keys in a are below b's
+ */
+static range_t *join_ranges(range_t *a, range_t *b)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (a->prio > b->prio) {
+		a->right = join_ranges(a->right, b);
+		return a;
+	}
+	b->left = join_ranges(a, b->left);
+	return b;
+}
+
+/*
+ * ceil_range - the range with the lowest lo >= addr, or NULL
+ */
+static range_t *ceil_range(range_t *t, char *addr)
+{
+	range_t *best = NULL;
+
+	while (t != NULL) {
+		if (t->lo >= addr) {
+			best = t;
+			t = t->left;
+		} else {
+			t = t->right;
+		}
+	}
+	return best;
+}
+
+/*
+ * floor_range - the range with the highest lo <= addr, or NULL
+ */
+static range_t *floor_range(range_t *t, char *addr)
+{
+	range_t *best = NULL;
+
+	while (t != NULL) {
+		if (t->lo <= addr) {
+			best = t;
+			t = t->right;
+		} else {
+			t = t->left;
+		}
+	}
+	return best;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range struct for this block and add it to the range tree.
  */
 static int add_range(range_t **ranges, char *lo, int size,
 		const trace_t *trace, int opnum, int index)
@@ -555,33 +1197,30 @@ static int add_range(range_t **ranges, char *lo, int size,
 		return 0;
 	}
 
-	/* If we can't afford the linear-time loop, we check less thoroughly and
-	   just assume the overlap will be caught by writing random bits. */
-	if(trace->ignore_ranges || debug_mode == DBG_NONE) return 1;
+	if(debug_mode == DBG_NONE) return 1;
 
-
-	/* The payload must not overlap any other payloads */
-	for (p = *ranges;  p != NULL;  p = p->next) {
-		if ((lo >= p->lo && lo <= p-> hi) ||
-				(hi >= p->lo && hi <= p->hi)) {
-			malloc_error(trace, opnum,
-					"Payload (%p:%p) overlaps another payload (%p:%p)\n",
-					lo, hi, p->lo, p->hi);
-			return 0;
-		}
+	/*
+	 * The payload must not overlap any other payloads. The ranges in the
+	 * tree are disjoint, so only the one starting closest below hi can.
+	 */
+	p = floor_range(*ranges, hi);
+	if (p != NULL && p->hi >= lo) {
+		malloc_error(trace, opnum,
+				"Payload (%p:%p) overlaps another payload (%p:%p)\n",
+				lo, hi, p->lo, p->hi);
+		return 0;
 	}
 
 	/*
 	 * Everything looks OK, so remember the extent of this block
-	 * by creating a range struct and adding it the range list.
+	 * by creating a range struct and adding it the range tree.
 	 */
-	if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-		unix_error("malloc error in add_range");
-	p->next = *ranges;
+	p = new_range();
+	p->left = p->right = NULL;
 	p->lo = lo;
 	p->hi = hi;
 	p->index = index;
-	*ranges = p;
+	*ranges = insert_range(*ranges, p);
 
 	return 1;
 }
@@ -591,18 +1230,14 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
+	range_t **pp = ranges;
 	range_t *p;
-	range_t **prevpp = ranges;
-	// int size;
-
-	for (p = *ranges;  p != NULL; p = p->next) {
-		if (p->lo == lo) {
-			*prevpp = p->next;
-			// size = p->hi - p->lo + 1;
-			free(p);
-			break;
-		}
-		prevpp = &(p->next);
+
+	while ((p = *pp) != NULL && p->lo != lo)
+		pp = (lo < p->lo) ? &p->left : &p->right;
+	if (p != NULL) {
+		*pp = join_ranges(p->left, p->right);
+		put_range(p);
 	}
 }
 
@@ -610,15 +1245,45 @@ static void remove_range(range_t **ranges, char *lo)
  * clear_ranges - free all of the range records for a trace
  */
 static void clear_ranges(range_t **ranges)
+{
+	range_t *p = *ranges;
+
+	if (p == NULL)
+		return;
+	clear_ranges(&p->left);
+	clear_ranges(&p->right);
+	put_range(p);
+	*ranges = NULL;
+}
+
+/*
+ * check_neighbors - check the data in the block at lo, if there still is
+ *     one, and in the blocks just below and above it
+ */
+static void check_neighbors(const trace_t *trace, int opnum, range_t *r,
+		char *lo)
 {
 	range_t *p;
-	range_t *pnext;
 
-	for (p = *ranges;  p != NULL;  p = pnext) {
-		pnext = p->next;
-		free(p);
+	if ((p = floor_range(r, lo - 1)) != NULL)
+		check_index(trace, opnum, p->index);
+	if ((p = ceil_range(r, lo)) != NULL) {
+		check_index(trace, opnum, p->index);
+		if (p->lo == lo && (p = ceil_range(r, lo + 1)) != NULL)
+			check_index(trace, opnum, p->index);
 	}
-	*ranges = NULL;
+}
+
+/*
+ * check_ranges - check the data in every block in the range tree
+ */
+static void check_ranges(const trace_t *trace, int opnum, range_t *r)
+{
+	if (r == NULL)
+		return;
+	check_ranges(trace, opnum, r->left);
+	check_index(trace, opnum, r->index);
+	check_ranges(trace, opnum, r->right);
 }
 
 /**********************************************
@@ -636,11 +1301,17 @@ static void init_random_data(void) {
 	}
 }
 
+/*
+ * The data for block index is random_data read from offset base on,
+ * wrapping around at RANDOM_DATA_LEN. Both routines below work one
+ * unwrapped run at a time with memcpy and memcmp, which are as wide as
+ * the machine allows; only a run that fails memcmp is rescanned byte by
+ * byte to say where the damage is.
+ */
 static void randomize_block(trace_t *traces, int index) {
 	size_t size;
-	size_t i;
+	size_t i, n, off;
 	randint_t *block;
-	int base;
 
 	if(debug_mode == DBG_NONE) return;
 
@@ -648,18 +1319,18 @@ static void randomize_block(trace_t *traces, int index) {
 
 	block = (randint_t*)traces->blocks[index];
 	size = traces->block_sizes[index] / sizeof(*block);
-	base = traces->block_rand_base[index];
+	off = (size_t)traces->block_rand_base[index] % RANDOM_DATA_LEN;
 
-	for(i = 0; i < size; i++) {
-		block[i] = random_data[(base + i) % RANDOM_DATA_LEN];
+	for(i = 0; i < size; i += n, off = 0) {
+		n = size - i < RANDOM_DATA_LEN - off ? size - i : RANDOM_DATA_LEN - off;
+		memcpy(block + i, random_data + off, n * sizeof(*block));
 	}
 }
 
 static void check_index(const trace_t *trace, int opnum, int index) {
 	size_t size;
-	size_t i;
+	size_t i, j, n, off;
 	randint_t *block;
-	int base;
 	int ngarbled = 0;
 	int firstgarbled = -1;
 
@@ -668,12 +1339,17 @@ static void check_index(const trace_t *trace, int opnum, int index) {
 
 	block = (randint_t*)trace->blocks[index];
 	size = trace->block_sizes[index] / sizeof(*block);
-	base = trace->block_rand_base[index];
-
-	for(i = 0; i < size; i++) {
-		if(block[i] != random_data[(base + i) % RANDOM_DATA_LEN]) {
-			if(firstgarbled == -1) firstgarbled = i;
-			ngarbled++;
+	off = (size_t)trace->block_rand_base[index] % RANDOM_DATA_LEN;
+
+	for(i = 0; i < size; i += n, off = 0) {
+		n = size - i < RANDOM_DATA_LEN - off ? size - i : RANDOM_DATA_LEN - off;
+		if(memcmp(block + i, random_data + off, n * sizeof(*block)) == 0)
+			continue;
+		for(j = 0; j < n; j++) {
+			if(block[i + j] != random_data[off + j]) {
+				if(firstgarbled == -1) firstgarbled = i + j;
+				ngarbled++;
+			}
 		}
 	}
 	if(ngarbled != 0) {
@@ -695,10 +1371,11 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 {
 	FILE *tracefile;
 	trace_t *trace;
-	char type[MAXLINE];
-	int index, size;
-	int max_index = 0;
-	int op_index;
+	repb_header_t hdr;
+	char cache[MAXLINE + 1];
+	struct stat st;
+	long long mtime = -1;
+	size_t len;
 
 	if (verbose > 1)
 		printf("Reading tracefile: %s\n", filename);
@@ -707,12 +1384,102 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 		unix_error("malloc 1 failed in read_trace");
 
-	/* Read the trace file header */
 	strcpy(trace->filename, tracedir);
 	strcat(trace->filename, filename);
+
+	/* With -C, a text trace is parsed once into a binary copy next to
+	   it (x.rep -> x.repb), which is mapped for as long as the text
+	   keeps the mtime it had when the copy was made */
+	len = strlen(trace->filename);
+	if (use_cache && !stream_traces && len > 4 &&
+			strcmp(trace->filename + len - 4, ".rep") == 0 &&
+			stat(trace->filename, &st) == 0) {
+		sprintf(cache, "%sb", trace->filename);
+		mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+		if (cache_fresh(cache, mtime))
+			return map_trace(trace, stats, cache);
+	}
+
+	/* Read the trace file header */
 	if ((tracefile = fopen(trace->filename, "r")) == NULL) {
 		unix_error("Could not open %s in read_trace", trace->filename);
 	}
+
+	/* Binary traces are mapped rather than parsed (or streamed with -S) */
+	if (fread(&hdr, sizeof(hdr), 1, tracefile) == 1 &&
+			memcmp(hdr.magic, REPB_MAGIC, sizeof(hdr.magic)) == 0) {
+		if (!stream_traces) {
+			fclose(tracefile);
+			return map_trace(trace, stats, trace->filename);
+		}
+		if (hdr.version != REPB_VERSION)
+			app_error("%s: binary trace version %d, expected %d",
+					trace->filename, hdr.version, REPB_VERSION);
+		trace->weight = hdr.weight;
+		trace->num_ids = hdr.num_ids;
+		trace->num_ops = hdr.num_ops;
+		trace->ignore_ranges = hdr.ignore_ranges;
+		if(trace->weight != 0 && trace->weight != 1) {
+			app_error("%s: weight can only be zero or one", trace->filename);
+		}
+		open_stream(trace, tracefile, 1);
+	} else {
+		rewind(tracefile);
+		read_trace_file(trace, tracefile);
+		if (mtime >= 0 && write_trace(trace, cache, mtime) < 0 && verbose > 1)
+			printf("Could not write the trace cache %s\n", cache);
+	}
+
+	/* fill in the stats */
+	strcpy(stats->filename, trace->filename);
+	stats->weight = trace->weight;
+	stats->ops = trace->num_ops;
+
+	return trace;
+}
+
+/*
+ * read_trace_stdin - read a trace from stdin and store it in memory
+ */
+static trace_t *read_trace_stdin(stats_t *stats)
+{
+	trace_t *trace;
+
+	if (verbose > 1)
+		printf("Reading tracefile from stdin\n");
+	if (stream_traces)
+		app_error("-S cannot replay a trace from stdin more than once");
+
+	/* Allocate the trace record */
+	if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+		unix_error("malloc 1 failed in read_trace");
+
+	strcpy(trace->filename, "stdin");
+	read_trace_file(trace, stdin);
+
+	/* fill in the stats */
+	strcpy(stats->filename, "stdin");
+	stats->weight = trace->weight;
+	stats->ops = trace->num_ops;
+
+	return trace;
+}
+
+/*
+ * read_trace_file - read a text trace from tracefile into trace; with -S
+ *     read only the header and leave the requests to the stream
+ */
+static void read_trace_file(trace_t *trace, FILE *tracefile)
+{
+	int max_index = 0;
+	int op_index;
+	traceop_t *op;
+
+	trace->map = NULL;
+	trace->map_len = 0;
+	trace->stream = NULL;
+
+	/* Read the trace file header */
 	if (fscanf(tracefile, "%d", &trace->weight)) {}
 	if (fscanf(tracefile, "%d", &trace->num_ids)) {}
 	if (fscanf(tracefile, "%d", &trace->num_ops)) {}
@@ -725,10 +1492,19 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		app_error("%s: ignore-ranges can only be zero or one", trace->filename);
 	}
 
-	/* We'll store each request line in the trace in this array */
+	if (stream_traces) {
+		open_stream(trace, tracefile, 0);
+		return;
+	}
+
+	/* We'll store each request line in the trace in this array
+	   (zeroed, so that ops without a hint can be written out as is) */
 	if ((trace->ops =
-				(traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+				(traceop_t *)calloc(trace->num_ops, sizeof(traceop_t))) == NULL)
 		unix_error("malloc 2 failed in read_trace");
+	trace->op_base = 0;
+	trace->op_count = trace->num_ops;
+	trace->num_slots = trace->num_ids;
 
 	/* We'll keep an array of pointers to the allocated blocks here... */
 	if ((trace->blocks =
@@ -747,144 +1523,531 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 
 
 	/* read every request line in the trace file */
-	index = 0;
-	op_index = 0;
-	while (fscanf(tracefile, "%s", type) != EOF) {
-		switch(type[0]) {
-			case 'a':
-				if (fscanf(tracefile, "%u %u", &index, &size)) {}
-				trace->ops[op_index].type = ALLOC;
-				trace->ops[op_index].index = index;
-				trace->ops[op_index].size = size;
-				max_index = (index > max_index) ? index : max_index;
-				break;
-			case 'r':
-				if (fscanf(tracefile, "%u %u", &index, &size)) {}
-				trace->ops[op_index].type = REALLOC;
-				trace->ops[op_index].index = index;
-				trace->ops[op_index].size = size;
-				max_index = (index > max_index) ? index : max_index;
-				break;
-			case 'f':
-				if (fscanf(tracefile, "%ud", &index)) {}
-				trace->ops[op_index].type = FREE;
-				trace->ops[op_index].index = index;
-				break;
-			default:
-				app_error("Bogus type character (%c) in tracefile %s\n",
-						type[0], trace->filename);
-		}
-		op_index++;
-		if(op_index == trace->num_ops) break;
+	for (op_index = 0; op_index < trace->num_ops; op_index++) {
+		op = &trace->ops[op_index];
+		if (!read_op(tracefile, trace->filename, op))
+			break;
+		if (op->type != FREE && op->index > max_index)
+			max_index = op->index;
 	}
 	fclose(tracefile);
 	assert(max_index == trace->num_ids - 1);
 	assert(trace->num_ops == op_index);
-
-	/* fill in the stats */
-	strcpy(stats->filename, trace->filename);
-	stats->weight = trace->weight;
-	stats->ops = trace->num_ops;
-
-	return trace;
 }
 
 /*
- * read_trace_stdin - read a trace from stdin and store it in memory
+ * read_op - read the next request line of a text trace into op;
+ *     returns 0 at the end of the file. Lines are split by hand, as
+ *     fscanf is slow enough to hold up a streamed replay.
  */
-static trace_t *read_trace_stdin(stats_t *stats)
+static int read_op(FILE *tracefile, const char *filename, traceop_t *op)
 {
-	FILE *tracefile;
-	trace_t *trace;
-	char type[MAXLINE];
-	int index, size;
-	int max_index = 0;
-	int op_index;
+	char line[MAXLINE], *p;
 
-	if (verbose > 1)
-		printf("Reading tracefile from stdin\n");
+	/* skip blank lines, such as the end of the header line */
+	do {
+		if (fgets(line, MAXLINE, tracefile) == NULL)
+			return 0;
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+	} while (*p == '\0');
 
-	/* Allocate the trace record */
-	if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
-		unix_error("malloc 1 failed in read_trace");
+	switch(*p++) {
+		case 'a':
+			op->type = ALLOC;
+			break;
+		case 'r':
+			op->type = REALLOC;
+			break;
+		case 'f':
+			op->type = FREE;
+			break;
+		default:
+			app_error("Bogus type character (%c) in tracefile %s\n",
+					p[-1], filename);
+	}
+	op->index = strtol(p, &p, 10);
+	op->size = op->type == FREE ? 0 : strtoul(p, &p, 10);
+	op->hint = op->type == ALLOC ? read_hint(p, filename) : MM_HINT_NONE;
+	op->thread = read_thread(p, filename);
+	return 1;
+}
 
-	/* Read the trace file header */
-	strcpy(trace->filename, "stdin");
-	tracefile = stdin;
+/*
+ * read_hint - read the optional lifetime hint column at the end of an
+ *     alloc line ("a <id> <size> [<hint>]"); no column means MM_HINT_NONE
+ */
+static int read_hint(const char *rest, const char *filename)
+{
+	char *end;
+	long hint;
+
+	hint = strtol(rest, &end, 10);
+	if (end == rest)
+		return MM_HINT_NONE;
+	if (hint < 0 || hint >= MM_NHINTS)
+		app_error("%s: bogus lifetime hint %ld\n", filename, hint);
+	return hint;
+}
 
-	if (fscanf(tracefile, "%d", &trace->weight)) {}
-	if (fscanf(tracefile, "%d", &trace->num_ids)) {}
-	if (fscanf(tracefile, "%d", &trace->num_ops)) {}
-	if (fscanf(tracefile, "%d", &trace->ignore_ranges)) {}
+/*
+ * read_thread - read the optional thread column, which ends any request
+ *     line ("f <id> [@<thread>]"); no column means thread 0
+ */
+static int read_thread(const char *rest, const char *filename)
+{
+	long thread;
+
+	if ((rest = strchr(rest, '@')) == NULL)
+		return 0;
+	thread = strtol(rest + 1, NULL, 10);
+	if (thread < 0 || thread >= MAX_THREADS)
+		app_error("%s: bogus thread %ld\n", filename, thread);
+	return thread;
+}
 
+/*
+ * map_trace - map the binary trace at path (trace->filename, or its
+ *     cache) and replay it in place; only the per-block arrays are
+ *     allocated
+ */
+static trace_t *map_trace(trace_t *trace, stats_t *stats, const char *path)
+{
+	int fd, i;
+	struct stat st;
+	const repb_header_t *hdr;
+	const traceop_t *op;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		unix_error("Could not open %s in map_trace", path);
+	if (fstat(fd, &st) < 0)
+		unix_error("Could not stat %s in map_trace", path);
+	if ((size_t)st.st_size < sizeof(repb_header_t))
+		app_error("%s: truncated binary trace", path);
+	trace->map_len = st.st_size;
+	trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (trace->map == MAP_FAILED)
+		unix_error("mmap failed in map_trace");
+	close(fd);
+
+	hdr = trace->map;
+	if (hdr->version != REPB_VERSION)
+		app_error("%s: binary trace version %d, expected %d",
+				trace->filename, hdr->version, REPB_VERSION);
+	trace->weight = hdr->weight;
+	trace->num_ids = hdr->num_ids;
+	trace->num_ops = hdr->num_ops;
+	trace->ignore_ranges = hdr->ignore_ranges;
+	trace->ops = (traceop_t *)(hdr + 1);
+	trace->op_base = 0;
+	trace->op_count = trace->num_ops;
+	trace->num_slots = trace->num_ids;
+	trace->stream = NULL;
+	if (trace->num_ids < 0 || trace->num_ops < 0 ||
+			trace->map_len != sizeof(*hdr) + trace->num_ops * sizeof(traceop_t))
+		app_error("%s: bad binary trace header", trace->filename);
 	if(trace->weight != 0 && trace->weight != 1) {
 		app_error("%s: weight can only be zero or one", trace->filename);
 	}
-	if(trace->ignore_ranges != 0 && trace->ignore_ranges != 1) {
-		app_error("%s: ignore-ranges can only be zero or one", trace->filename);
-	}
 
-	/* We'll store each request line in the trace in this array */
-	if ((trace->ops =
-				(traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-		unix_error("malloc 2 failed in read_trace");
+	/* A bad index would send the replay outside the block arrays;
+	   checking costs one sequential pass, still far less than parsing */
+	for (i = 0, op = trace->ops; i < trace->num_ops; i++, op++) {
+		if (op->type > REALLOC || op->hint >= MM_NHINTS ||
+				op->thread >= MAX_THREADS ||
+				op->index < (op->type == FREE ? -1 : 0) ||
+				op->index >= trace->num_ids)
+			app_error("%s: bad request %d in binary trace", trace->filename, i);
+	}
 
-	/* We'll keep an array of pointers to the allocated blocks here... */
 	if ((trace->blocks =
 				(char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
-		unix_error("malloc 3 failed in read_trace");
-
-	/* ... along with the corresponding byte sizes of each block */
+		unix_error("malloc 3 failed in map_trace");
 	if ((trace->block_sizes =
 				(size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
-		unix_error("malloc 4 failed in read_trace");
-
-	/* and, if we're debugging, the offset into the random data */
+		unix_error("malloc 4 failed in map_trace");
 	if ((trace->block_rand_base =
 				calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
-		unix_error("malloc 5 failed in read_trace");
+		unix_error("malloc 5 failed in map_trace");
 
+	/* fill in the stats */
+	strcpy(stats->filename, trace->filename);
+	stats->weight = trace->weight;
+	stats->ops = trace->num_ops;
 
-	/* read every request line in the trace file */
-	index = 0;
-	op_index = 0;
-	while (fscanf(tracefile, "%s", type) != EOF) {
-		switch(type[0]) {
-			case 'a':
-				if (fscanf(tracefile, "%u %u", &index, &size)) {}
-				trace->ops[op_index].type = ALLOC;
-				trace->ops[op_index].index = index;
-				trace->ops[op_index].size = size;
-				max_index = (index > max_index) ? index : max_index;
-				break;
-			case 'r':
-				if (fscanf(tracefile, "%u %u", &index, &size)) {}
-				trace->ops[op_index].type = REALLOC;
-				trace->ops[op_index].index = index;
-				trace->ops[op_index].size = size;
-				max_index = (index > max_index) ? index : max_index;
-				break;
-			case 'f':
-				if (fscanf(tracefile, "%ud", &index)) {}
-				trace->ops[op_index].type = FREE;
-				trace->ops[op_index].index = index;
+	return trace;
+}
+
+/*
+ * write_trace - write a trace in the binary format (for -B and -C),
+ *     through a temporary file so that no reader sees half of it.
+ *     Returns 0 on success, -1 on failure.
+ */
+static int write_trace(const trace_t *trace, const char *filename,
+		long long mtime)
+{
+	FILE *file;
+	repb_header_t hdr;
+	char tmp[MAXLINE + 16];
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, REPB_MAGIC, sizeof(hdr.magic));
+	hdr.version = REPB_VERSION;
+	hdr.weight = trace->weight;
+	hdr.num_ids = trace->num_ids;
+	hdr.num_ops = trace->num_ops;
+	hdr.ignore_ranges = trace->ignore_ranges;
+	hdr.mtime = mtime;
+
+	sprintf(tmp, "%s.%d", filename, (int)getpid());
+	if ((file = fopen(tmp, "w")) == NULL)
+		return -1;
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+			fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, file)
+			!= (size_t)trace->num_ops || fclose(file) != 0 ||
+			rename(tmp, filename) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * cache_fresh - is cache a binary copy of a text trace with this mtime?
+ */
+static int cache_fresh(const char *cache, long long mtime)
+{
+	FILE *file;
+	repb_header_t hdr;
+	int fresh;
+
+	if ((file = fopen(cache, "r")) == NULL)
+		return 0;
+	fresh = fread(&hdr, sizeof(hdr), 1, file) == 1 &&
+		memcmp(hdr.magic, REPB_MAGIC, sizeof(hdr.magic)) == 0 &&
+		hdr.version == REPB_VERSION && hdr.mtime == mtime;
+	fclose(file);
+	return fresh;
+}
+
+/*
+ * slot_hash - the first place to look for id in the stream's id map
+ */
+static int slot_hash(const stream_t *s, int id)
+{
+	return (int)(((unsigned)id * 2654435761u) & (unsigned)(s->map_size - 1));
+}
+
+/*
+ * slot_put - map id to slot, growing the map to keep it half empty
+ */
+static void slot_put(stream_t *s, int id, int slot)
+{
+	int i, *ids, *slots, size;
+
+	if (2 * (s->map_used + 1) > s->map_size) {
+		ids = s->ids;
+		slots = s->slots;
+		size = s->map_size;
+		s->map_size = size ? 2 * size : 1024;
+		s->ids = malloc(s->map_size * sizeof(int));
+		s->slots = malloc(s->map_size * sizeof(int));
+		if (s->ids == NULL || s->slots == NULL)
+			unix_error("malloc failed in slot_put");
+		memset(s->ids, -1, s->map_size * sizeof(int));
+		s->map_used = 0;
+		for (i = 0; i < size; i++)
+			if (ids[i] >= 0)
+				slot_put(s, ids[i], slots[i]);
+		free(ids);
+		free(slots);
+	}
+
+	for (i = slot_hash(s, id); s->ids[i] >= 0 && s->ids[i] != id;
+			i = (i + 1) & (s->map_size - 1))
+		;
+	if (s->ids[i] < 0)
+		s->map_used++;
+	s->ids[i] = id;
+	s->slots[i] = slot;
+}
+
+/*
+ * slot_get - the slot of id, or -1; with remove, also drop id from the map
+ */
+static int slot_get(stream_t *s, int id, int remove)
+{
+	int i, j, h, slot;
+
+	if (s->map_size == 0)
+		return -1;
+	for (i = slot_hash(s, id); s->ids[i] != id; i = (i + 1) & (s->map_size - 1))
+		if (s->ids[i] < 0)
+			return -1;
+	slot = s->slots[i];
+	if (!remove)
+		return slot;
+
+	/* close the gap, so that every id stays reachable from its hash */
+	for (j = (i + 1) & (s->map_size - 1); s->ids[j] >= 0;
+			j = (j + 1) & (s->map_size - 1)) {
+		h = slot_hash(s, s->ids[j]);
+		if ((j > i && (h <= i || h > j)) || (j < i && h <= i && h > j)) {
+			s->ids[i] = s->ids[j];
+			s->slots[i] = s->slots[j];
+			i = j;
+		}
+	}
+	s->ids[i] = -1;
+	s->map_used--;
+	return slot;
+}
+
+/*
+ * rename_op - turn the block id of op into a slot
+ */
+static void rename_op(stream_t *s, traceop_t *op, int opnum)
+{
+	int slot;
+
+	if (op->type > REALLOC || op->hint >= MM_NHINTS || op->thread >= MAX_THREADS)
+		app_error("%s: bad request %d", s->filename, opnum);
+	if (op->type == ALLOC) {
+		if (op->index < 0)
+			app_error("%s: bad request %d", s->filename, opnum);
+		slot = s->num_free ? s->free_slots[--s->num_free] : s->num_slots++;
+		slot_put(s, op->index, slot);
+		op->index = slot;
+	} else if (op->type == REALLOC && slot_get(s, op->index, 0) < 0) {
+		/* a realloc of a block never allocated is realloc(NULL, size),
+		   as in a loaded trace. Its slot must hold NULL, so it is a new
+		   one rather than a recycled slot, whose freed block is still
+		   in the block arrays. */
+		if (op->index < 0)
+			app_error("%s: bad request %d", s->filename, opnum);
+		slot = s->num_slots++;
+		slot_put(s, op->index, slot);
+		op->index = slot;
+	} else if (op->type == REALLOC || op->index >= 0) {
+		if ((slot = slot_get(s, op->index, op->type == FREE)) < 0)
+			app_error("%s: request %d uses block %d, which is not allocated",
+					s->filename, opnum, op->index);
+		if (op->type == FREE) {
+			if (s->num_free == s->free_size) {
+				s->free_size = s->free_size ? 2 * s->free_size : 1024;
+				s->free_slots = realloc(s->free_slots,
+						s->free_size * sizeof(int));
+				if (s->free_slots == NULL)
+					unix_error("realloc failed in rename_op");
+			}
+			s->free_slots[s->num_free++] = slot;
+		}
+		op->index = slot;
+	}
+}
+
+/*
+ * stream_reader - the reader thread: fill the windows by turns, one
+ *     ahead of the replay, until the trace ends or it is told to stop
+ */
+static void *stream_reader(void *arg)
+{
+	stream_t *s = arg;
+	window_t *w;
+	int n = 0, opnum = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		while (s->filled[n] && !s->stop)
+			pthread_cond_wait(&s->cond, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+		if (s->stop)
+			break;
+
+		w = &s->win[n];
+		for (w->count = 0; w->count < STREAM_WINDOW; w->count++, opnum++) {
+			traceop_t *op = &w->ops[w->count];
+			if (s->binary ? fread(op, sizeof(*op), 1, s->file) != 1
+					: !read_op(s->file, s->filename, op))
 				break;
-			default:
-				app_error("Bogus type character (%c) from stdin\n",
-						type[0]);
+			rename_op(s, op, opnum);
 		}
-		op_index++;
-		if(op_index == trace->num_ops) break;
+		w->num_slots = s->num_slots;
+
+		pthread_mutex_lock(&s->lock);
+		s->filled[n] = 1;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		if (w->count == 0)
+			break;
+		n ^= 1;
 	}
-	fclose(tracefile);
-	assert(max_index == trace->num_ids - 1);
-	assert(trace->num_ops == op_index);
+	return NULL;
+}
 
-	/* fill in the stats */
-	strcpy(stats->filename, "stdin");
-	stats->weight = trace->weight;
-	stats->ops = trace->num_ops;
+/*
+ * stop_reader - stop the reader thread, wherever it is in the trace
+ */
+static void stop_reader(stream_t *s)
+{
+	if (!s->running)
+		return;
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->reader, NULL);
+	s->running = 0;
+}
+
+/*
+ * open_stream - set trace up to be streamed from file, whose position
+ *     is at the first request
+ */
+static void open_stream(trace_t *trace, FILE *file, int binary)
+{
+	stream_t *s;
+	int i;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		unix_error("calloc failed in open_stream");
+	s->file = file;
+	s->start = ftell(file);
+	s->binary = binary;
+	s->filename = trace->filename;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	for (i = 0; i < 2; i++)
+		if ((s->win[i].ops = calloc(STREAM_WINDOW, sizeof(traceop_t))) == NULL)
+			unix_error("calloc failed in open_stream");
+
+	trace->stream = s;
+	trace->map = NULL;
+	trace->map_len = 0;
+	trace->ops = NULL;
+	trace->op_base = 0;
+	trace->op_count = 0;
+	trace->num_slots = 0;
+	trace->blocks = NULL;
+	trace->block_sizes = NULL;
+	trace->block_rand_base = NULL;
+}
+
+/*
+ * restart_stream - go back to the start of a streamed trace
+ */
+static void restart_stream(trace_t *trace)
+{
+	stream_t *s = trace->stream;
+
+	stop_reader(s);
+	if (fseek(s->file, s->start, SEEK_SET) < 0)
+		unix_error("fseek failed in restart_stream");
+	if (s->map_size)
+		memset(s->ids, -1, s->map_size * sizeof(int));
+	s->map_used = 0;
+	s->num_free = 0;
+	s->num_slots = 0;
+	s->filled[0] = s->filled[1] = 0;
+	s->cur = -1;
+	s->stop = 0;
+	trace->op_base = 0;
+	trace->op_count = 0;
+
+	if (pthread_create(&s->reader, NULL, stream_reader, s) != 0)
+		app_error("pthread_create failed in restart_stream");
+	s->running = 1;
+}
+
+/*
+ * close_stream - stop streaming and free what the stream holds
+ */
+static void close_stream(trace_t *trace)
+{
+	stream_t *s = trace->stream;
+
+	stop_reader(s);
+	fclose(s->file);
+	free(s->win[0].ops);
+	free(s->win[1].ops);
+	free(s->ids);
+	free(s->slots);
+	free(s->free_slots);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+	trace->stream = NULL;
+}
+
+/*
+ * next_window - hand the replayed window back to the reader and move on
+ *     to the next one, which starts with request opnum
+ */
+static traceop_t *next_window(trace_t *trace, int opnum)
+{
+	stream_t *s = trace->stream;
+	window_t *w;
+	int n;
+
+	assert(s != NULL && opnum == trace->op_base + trace->op_count);
+
+	pthread_mutex_lock(&s->lock);
+	if (s->cur >= 0) {
+		s->filled[s->cur] = 0;
+		pthread_cond_broadcast(&s->cond);
+	}
+	s->cur = s->cur < 0 ? 0 : s->cur ^ 1;
+	while (!s->filled[s->cur])
+		pthread_cond_wait(&s->cond, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+
+	w = &s->win[s->cur];
+	if (w->count == 0)
+		app_error("%s: the trace ends at request %d of %d",
+				trace->filename, opnum, trace->num_ops);
+
+	/* make room for the slots that the new requests use */
+	if (w->num_slots > trace->num_slots) {
+		n = w->num_slots + w->num_slots / 2;
+		trace->blocks = realloc(trace->blocks, n * sizeof(*trace->blocks));
+		trace->block_sizes = realloc(trace->block_sizes,
+				n * sizeof(*trace->block_sizes));
+		trace->block_rand_base = realloc(trace->block_rand_base,
+				n * sizeof(*trace->block_rand_base));
+		if (trace->blocks == NULL || trace->block_sizes == NULL ||
+				trace->block_rand_base == NULL)
+			unix_error("realloc failed in next_window");
+		memset(trace->blocks + trace->num_slots, 0,
+				(n - trace->num_slots) * sizeof(*trace->blocks));
+		memset(trace->block_sizes + trace->num_slots, 0,
+				(n - trace->num_slots) * sizeof(*trace->block_sizes));
+		trace->num_slots = n;
+	}
+
+	trace->ops = w->ops;
+	trace->op_base = opnum;
+	trace->op_count = w->count;
+	return trace->ops;
+}
 
+/*
+ * load_trace - read trace i the first time a pass asks for it, and hand
+ *     the same trace to every later pass (libc, then mm)
+ */
+static trace_t *load_trace(trace_t **traces, int i, char trace_from_stdin,
+		const char *tracedir, char **tracefiles, stats_t *stats)
+{
+	trace_t *trace = traces[i];
+
+	if (trace == NULL) {
+		trace = traces[i] = trace_from_stdin
+			? read_trace_stdin(stats)
+			: read_trace(stats, tracedir, tracefiles[i]);
+	} else {
+		strcpy(stats->filename, trace->filename);
+		stats->weight = trace->weight;
+		stats->ops = trace->num_ops;
+	}
 	return trace;
 }
 
@@ -893,18 +2056,26 @@ static trace_t *read_trace_stdin(stats_t *stats)
  */
 static void reinit_trace(trace_t *trace)
 {
-	memset(trace->blocks, 0, trace->num_ids * sizeof(*trace->blocks));
-	memset(trace->block_sizes, 0, trace->num_ids * sizeof(*trace->block_sizes));
+	if (trace->stream)
+		restart_stream(trace);
+	memset(trace->blocks, 0, trace->num_slots * sizeof(*trace->blocks));
+	memset(trace->block_sizes, 0, trace->num_slots * sizeof(*trace->block_sizes));
 	/* block_rand_base is unused if size is zero */
 }
 
 /*
  * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace() (or
+ *              unmap the ops of a binary trace).
  */
 static void free_trace(trace_t *trace)
 {
-	free(trace->ops);         /* free the three arrays... */
+	if (trace->stream)        /* stop streaming... */
+		close_stream(trace);
+	else if (trace->map)      /* unmap a binary trace... */
+		munmap(trace->map, trace->map_len);
+	else
+		free(trace->ops);     /* or free the ops array... */
 	free(trace->blocks);
 	free(trace->block_sizes);
 	free(trace->block_rand_base);
@@ -927,6 +2098,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 	char *newp;
 	char *oldp;
 	char *p;
+	char *last = NULL;  /* block handled by the previous request */
+	int full;
+	mm_check_error_t check_err;
+	const traceop_t *op;
 
 	/* Reset the heap and free any records in the range list */
 	mem_reset_brk();
@@ -941,29 +2116,37 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 
 	/* Interpret each operation in the trace in order */
 	for (i = 0;  i < trace->num_ops;  i++) {
-		index = trace->ops[i].index;
-		size = trace->ops[i].size;
+		op = TRACE_OP(trace, i);
+		index = op->index;
+		size = op->size;
 
 		if(debug_mode == DBG_EXPENSIVE) {
-			range_t *r;
-			
-			/* Let the students check their own heap */
-			mm_checkheap(verbose);
-
-			/* Now check that all our allocated blocks have the right data */
-			r = *ranges;
-			while(r) {
-				check_index(trace, i, r->index);
-				r = r->next;
+			/* Let the students check the part of their heap that the last
+			   request touched, and all of it every check_period requests */
+			full = (i % check_period == 0);
+			if ((full ? mm_validate(MM_CHECK_ALL, &check_err)
+			     : mm_checkheap_incremental(&check_err)) < 0) {
+				malloc_error(trace, i, "mm_checkheap found a broken heap: "
+					     "%s (block %p)", check_err.msg, check_err.bp);
+				return 0;
 			}
+
+			/* Now check that our allocated blocks have the right data:
+			   all of them, or those around the last request's block */
+			if (full)
+				check_ranges(trace, i, *ranges);
+			else if (last != NULL)
+				check_neighbors(trace, i, *ranges, last);
 		}
 
-		switch (trace->ops[i].type) {
+		switch (op->type) {
 
 			case ALLOC: /* mm_malloc */
 
 				/* Call the student's malloc */
-				if ((p = mm_malloc(size)) == NULL) {
+				p = OP_HINT(op) ? mm_malloc_hint(size, OP_HINT(op))
+					: mm_malloc(size);
+				if (p == NULL) {
 					malloc_error(trace, i, "mm_malloc failed.");
 					return 0;
 				}
@@ -982,6 +2165,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 
 				/* Set to random data, for debugging. */
 				randomize_block(trace, index);
+				last = p;
 				break;
 
 			case REALLOC: /* mm_realloc */
@@ -1022,6 +2206,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 
 				/* Set to random data, for debugging. */
 				randomize_block(trace, index);
+				last = newp != NULL ? newp : oldp;
 				break;
 
 			case FREE: /* mm_free */
@@ -1035,6 +2220,8 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 					remove_range(ranges, p);
 				}
 				mm_free(p);
+				if (p != NULL)
+					last = p;
 				break;
 
 			default:
@@ -1058,8 +2245,13 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   is always the high water mark of the heap.
  *
  *   A higher number is better: 1 is optimal.
+ *
+ *   Every frag_period requests (and after the last) we also look at the
+ *   free space in the heap, and return in *frag the peak external
+ *   fragmentation: the free bytes outside the largest free block, as a
+ *   fraction of the heap. With -F each sample goes to the timeline too.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, double *frag)
 {
 	int i;
 	int index;
@@ -1068,6 +2260,9 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 	int total_size = 0;
 	char *p;
 	char *newp, *oldp;
+	const traceop_t *op;
+	mm_heap_stats_t hs;
+	double f;
 
 	reinit_trace(trace);
 
@@ -1075,15 +2270,19 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 	mem_reset_brk();
 	if (mm_init() < 0)
 		app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
+	*frag = 0;
 
 	for (i = 0;  i < trace->num_ops;  i++) {
-		switch (trace->ops[i].type) {
+		op = TRACE_OP(trace, i);
+		switch (op->type) {
 
 			case ALLOC: /* mm_alloc */
-				index = trace->ops[i].index;
-				size = trace->ops[i].size;
+				index = op->index;
+				size = op->size;
 
-				if ((p = mm_malloc(size)) == NULL) {
+				p = OP_HINT(op) ? mm_malloc_hint(size, OP_HINT(op))
+					: mm_malloc(size);
+				if (p == NULL) {
 					app_error("trace %d: mm_malloc failed in eval_mm_util",
 							tracenum);
 				}
@@ -1096,8 +2295,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 				break;
 
 			case REALLOC: /* mm_realloc */
-				index = trace->ops[i].index;
-				newsize = trace->ops[i].size;
+				index = op->index;
+				newsize = op->size;
 				oldsize = trace->block_sizes[index];
 
 				oldp = trace->blocks[index];
@@ -1114,7 +2313,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 				break;
 
 			case FREE: /* mm_free */
-				index = trace->ops[i].index;
+				index = op->index;
 				if(index < 0) {
 					size = 0;
 					p = 0;
@@ -1136,6 +2335,17 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 		/* update the high-water mark */
 		max_total_size = (total_size > max_total_size) ?
 			total_size : max_total_size;
+
+		/* sample the free space */
+		if ((i + 1) % frag_period == 0 || i == trace->num_ops - 1) {
+			mm_heap_stats(&hs);
+			f = (double)(hs.free_bytes - hs.largest_free) / mem_heapsize();
+			*frag = f > *frag ? f : *frag;
+			if (frag_file)
+				fprintf(frag_file, "%s,%d,%d,%zu,%zu,%zu,%zu\n",
+						trace->filename, i + 1, total_size, mem_heapsize(),
+						hs.free_bytes, hs.largest_free, hs.free_blocks);
+		}
 	}
 
 	printf(".");
@@ -1152,6 +2362,7 @@ static void eval_mm_speed(void *ptr)
 {
 	int i, index, size, newsize;
 	char *p, *newp, *oldp, *block;
+	const traceop_t *op;
 	trace_t *trace = ((speed_t *)ptr)->trace;
 	reinit_trace(trace);
 
@@ -1161,20 +2372,25 @@ static void eval_mm_speed(void *ptr)
 		app_error("mm_init failed in eval_mm_speed");
 
 	/* Interpret each trace request */
-	for (i = 0;  i < trace->num_ops;  i++)
-		switch (trace->ops[i].type) {
+	for (i = 0;  i < trace->num_ops;  i++) {
+		op = TRACE_OP(trace, i);
+		if (touch_payloads)
+			touch_before(trace, op);
+		switch (op->type) {
 
 			case ALLOC: /* mm_malloc */
-				index = trace->ops[i].index;
-				size = trace->ops[i].size;
-				if ((p = mm_malloc(size)) == NULL)
+				index = op->index;
+				size = op->size;
+				p = OP_HINT(op) ? mm_malloc_hint(size, OP_HINT(op))
+					: mm_malloc(size);
+				if (p == NULL)
 					app_error("mm_malloc error in eval_mm_speed");
 				trace->blocks[index] = p;
 				break;
 
 			case REALLOC: /* mm_realloc */
-				index = trace->ops[i].index;
-				newsize = trace->ops[i].size;
+				index = op->index;
+				newsize = op->size;
 				oldp = trace->blocks[index];
 				if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
 					app_error("mm_realloc error in eval_mm_speed");
@@ -1182,7 +2398,7 @@ static void eval_mm_speed(void *ptr)
 				break;
 
 			case FREE: /* mm_free */
-				index = trace->ops[i].index;
+				index = op->index;
 				if(index < 0) {
 					block = 0;
 				} else {
@@ -1194,6 +2410,11 @@ static void eval_mm_speed(void *ptr)
 			default:
 				app_error("Nonexistent request type in eval_mm_speed");
 		}
+		if (touch_payloads)
+			touch_after(trace, i, op);
+		if (noise_buf)
+			pollute();
+	}
 }
 
 /*
@@ -1206,33 +2427,35 @@ static int eval_libc_valid(trace_t *trace)
 {
 	int i, newsize;
 	char *p, *newp, *oldp;
+	const traceop_t *op;
 
 	reinit_trace(trace);
 
 	for (i = 0;  i < trace->num_ops;  i++) {
-		switch (trace->ops[i].type) {
+		op = TRACE_OP(trace, i);
+		switch (op->type) {
 
 			case ALLOC: /* malloc */
-				if ((p = malloc(trace->ops[i].size)) == NULL) {
+				if ((p = malloc(op->size)) == NULL) {
 					malloc_error(trace, i, "libc malloc failed");
 					unix_error("System message");
 				}
-				trace->blocks[trace->ops[i].index] = p;
+				trace->blocks[op->index] = p;
 				break;
 
 			case REALLOC: /* realloc */
-				newsize = trace->ops[i].size;
-				oldp = trace->blocks[trace->ops[i].index];
+				newsize = op->size;
+				oldp = trace->blocks[op->index];
 				if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0) {
 					malloc_error(trace, i, "libc realloc failed");
 					unix_error("System message");
 				}
-				trace->blocks[trace->ops[i].index] = newp;
+				trace->blocks[op->index] = newp;
 				break;
 
 			case FREE: /* free */
-				if(trace->ops[i].index >= 0) {
-					free(trace->blocks[trace->ops[i].index]);
+				if(op->index >= 0) {
+					free(trace->blocks[op->index]);
 				} else {
 					free(0);
 				}
@@ -1256,23 +2479,27 @@ static void eval_libc_speed(void *ptr)
 	int i;
 	int index, size, newsize;
 	char *p, *newp, *oldp, *block;
+	const traceop_t *op;
 	trace_t *trace = ((speed_t *)ptr)->trace;
 
 	reinit_trace(trace);
 
 	for (i = 0;  i < trace->num_ops;  i++) {
-		switch (trace->ops[i].type) {
+		op = TRACE_OP(trace, i);
+		if (touch_payloads)
+			touch_before(trace, op);
+		switch (op->type) {
 			case ALLOC: /* malloc */
-				index = trace->ops[i].index;
-				size = trace->ops[i].size;
+				index = op->index;
+				size = op->size;
 				if ((p = malloc(size)) == NULL)
 					unix_error("malloc failed in eval_libc_speed");
 				trace->blocks[index] = p;
 				break;
 
 			case REALLOC: /* realloc */
-				index = trace->ops[i].index;
-				newsize = trace->ops[i].size;
+				index = op->index;
+				newsize = op->size;
 				oldp = trace->blocks[index];
 				if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
 					unix_error("realloc failed in eval_libc_speed\n");
@@ -1281,7 +2508,7 @@ static void eval_libc_speed(void *ptr)
 				break;
 
 			case FREE: /* free */
-				index = trace->ops[i].index;
+				index = op->index;
 				if(index >= 0) {
 					block = trace->blocks[index];
 					free(block);
@@ -1290,7 +2517,328 @@ static void eval_libc_speed(void *ptr)
 				}
 				break;
 		}
+		if (touch_payloads)
+			touch_after(trace, i, op);
+		if (noise_buf)
+			pollute();
+	}
+}
+
+/*
+ * The threaded replay (-T). Each thread of a trace replays its own
+ * requests, in trace order, on its own pthread. A request waits until
+ * the previous request on the same block is done, wherever that ran.
+ * So a block freed by another thread is freed only after it has been
+ * allocated. The mm package keeps global state, so its calls are
+ * serialized by mm_lock; libc's calls run concurrently.
+ */
+typedef struct {
+	trace_t *trace;
+	int *prev;           /* previous request on the same block, or -1 */
+	char *done;          /* has each request been made? */
+	int use_libc;
+	pthread_barrier_t start;
+} mt_replay_t;
+
+typedef struct {
+	mt_replay_t *mt;
+	int *ops;            /* the requests of this thread, in trace order */
+	int num_ops;
+	double begin, end;   /* when this thread started and finished */
+} mt_thread_t;
+
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the time in seconds on a clock that only goes forward */
+static double mt_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * replay_thread - make one thread's requests (the pthread body)
+ */
+static void *replay_thread(void *arg)
+{
+	mt_thread_t *t = arg;
+	mt_replay_t *mt = t->mt;
+	trace_t *trace = mt->trace;
+	const traceop_t *op;
+	char *p;
+	int i, k, dep;
+
+	pthread_barrier_wait(&mt->start);
+	t->begin = mt_now();
+	for (k = 0; k < t->num_ops; k++) {
+		i = t->ops[k];
+		op = &trace->ops[i];
+		if ((dep = mt->prev[i]) >= 0)
+			while (!__atomic_load_n(&mt->done[dep], __ATOMIC_ACQUIRE))
+				sched_yield();
+
+		if (!mt->use_libc)
+			pthread_mutex_lock(&mm_lock);
+		switch (op->type) {
+			case ALLOC:
+				p = mt->use_libc ? malloc(op->size)
+					: OP_HINT(op) ? mm_malloc_hint(op->size, OP_HINT(op))
+					: mm_malloc(op->size);
+				if (p == NULL)
+					app_error("malloc failed in replay_thread");
+				trace->blocks[op->index] = p;
+				break;
+
+			case REALLOC:
+				p = trace->blocks[op->index];
+				p = mt->use_libc ? realloc(p, op->size) : mm_realloc(p, op->size);
+				if (p == NULL && op->size != 0)
+					app_error("realloc failed in replay_thread");
+				trace->blocks[op->index] = p;
+				break;
+
+			case FREE:
+				p = op->index >= 0 ? trace->blocks[op->index] : NULL;
+				if (mt->use_libc)
+					free(p);
+				else
+					mm_free(p);
+				break;
+		}
+		if (!mt->use_libc)
+			pthread_mutex_unlock(&mm_lock);
+		__atomic_store_n(&mt->done[i], 1, __ATOMIC_RELEASE);
+	}
+	t->end = mt_now();
+	return NULL;
+}
+
+/*
+ * eval_threads - replay a trace with one pthread per trace thread, on
+ *     libc or the mm package, and print the aggregate and per-thread
+ *     throughput of the fastest of THREAD_RUNS runs
+ */
+static void eval_threads(trace_t *trace, int use_libc)
+{
+	mt_replay_t mt;
+	mt_thread_t *threads;
+	pthread_t *tids;
+	int *last, *ops;
+	int i, j, run, num_threads = 0;
+	double begin, end, secs, best = DBL_MAX;
+	double *best_secs;
+
+	if (trace->stream)
+		app_error("-T cannot replay a streamed trace");
+
+	/* split the requests by thread, and chain them by block */
+	for (i = 0; i < trace->num_ops; i++)
+		if (trace->ops[i].thread >= num_threads)
+			num_threads = trace->ops[i].thread + 1;
+	threads = calloc(num_threads, sizeof(*threads));
+	tids = calloc(num_threads, sizeof(*tids));
+	best_secs = calloc(num_threads, sizeof(*best_secs));
+	ops = malloc(trace->num_ops * sizeof(*ops));
+	last = malloc(trace->num_slots * sizeof(*last));
+	mt.prev = malloc(trace->num_ops * sizeof(*mt.prev));
+	mt.done = malloc(trace->num_ops);
+	if (!threads || !tids || !best_secs || !ops || !last ||
+			!mt.prev || !mt.done)
+		unix_error("malloc failed in eval_threads");
+
+	for (i = 0; i < trace->num_ops; i++)
+		threads[trace->ops[i].thread].num_ops++;
+	for (i = 0, j = 0; i < num_threads; i++) {
+		threads[i].mt = &mt;
+		threads[i].ops = ops + j;
+		j += threads[i].num_ops;
+		threads[i].num_ops = 0;
+	}
+	for (i = 0; i < trace->num_slots; i++)
+		last[i] = -1;
+	for (i = 0; i < trace->num_ops; i++) {
+		mt_thread_t *t = &threads[trace->ops[i].thread];
+		t->ops[t->num_ops++] = i;
+		j = trace->ops[i].index;
+		mt.prev[i] = j >= 0 ? last[j] : -1;
+		if (j >= 0)
+			last[j] = i;
+	}
+	mt.trace = trace;
+	mt.use_libc = use_libc;
+
+	for (run = 0; run < THREAD_RUNS; run++) {
+		reinit_trace(trace);
+		if (!use_libc) {
+			mem_reset_brk();
+			if (mm_init() < 0)
+				app_error("mm_init failed in eval_threads");
+		}
+		memset(mt.done, 0, trace->num_ops);
+		pthread_barrier_init(&mt.start, NULL, num_threads);
+		for (i = 0; i < num_threads; i++)
+			if (pthread_create(&tids[i], NULL, replay_thread, &threads[i]) != 0)
+				app_error("pthread_create failed in eval_threads");
+		for (i = 0; i < num_threads; i++)
+			pthread_join(tids[i], NULL);
+		pthread_barrier_destroy(&mt.start);
+
+		/* libc blocks are still live; give them back */
+		if (use_libc)
+			for (j = 0; j < trace->num_slots; j++)
+				if (last[j] >= 0 && trace->ops[last[j]].type != FREE)
+					free(trace->blocks[j]);
+
+		begin = DBL_MAX;
+		end = 0;
+		for (i = 0; i < num_threads; i++) {
+			begin = threads[i].begin < begin ? threads[i].begin : begin;
+			end = threads[i].end > end ? threads[i].end : end;
+		}
+		if ((secs = end - begin) < best) {
+			best = secs;
+			for (i = 0; i < num_threads; i++)
+				best_secs[i] = threads[i].end - threads[i].begin;
+		}
+	}
+
+	if (verbose) {
+		printf("%s threads %s: %d threads, %.0f Kops",
+				use_libc ? "libc" : "mm", trace->filename, num_threads,
+				best > 0 ? trace->num_ops / 1e3 / best : 0.0);
+		for (i = 0; i < num_threads; i++)
+			printf("%s%.0f", i ? " " : " (per thread: ",
+					best_secs[i] > 0 ? threads[i].num_ops / 1e3 / best_secs[i] : 0.0);
+		printf(")\n");
+	}
+
+	free(threads);
+	free(tids);
+	free(best_secs);
+	free(ops);
+	free(last);
+	free(mt.prev);
+	free(mt.done);
+}
+
+/*
+ * eval_requests - replay a trace once more, on libc or the mm package,
+ *     reading the timing method's clock around every request (on the
+ *     core it times on), and break the time down by request type into
+ *     *stats. The latencies are less the cost of reading the clock, and
+ *     include the odd timer interrupt. With -L, also print the percentiles of each request
+ *     type and, with -G, append the histograms to the dump file.
+ */
+static void eval_requests(trace_t *trace, int use_libc, stats_t *stats)
+{
+	static const char *names[3] = { "malloc", "free", "realloc" };
+	static lat_hist_t hist[3];
+	const char *pkg = use_libc ? "libc" : "mm";
+	unsigned long long t0, t1, ovhd, d;
+	const traceop_t *op;
+	double realloc_bytes = 0;
+	char *p;
+	int i, j;
+
+	for (i = 0; i < 3; i++)
+		lat_reset(&hist[i]);
+	fsecs_pin();
+	ovhd = lat_overhead(fsecs_stamp);
+
+	reinit_trace(trace);
+	if (!use_libc) {
+		mem_reset_brk();
+		if (mm_init() < 0)
+			app_error("mm_init failed in eval_requests");
+	}
+
+	for (i = 0; i < trace->num_ops; i++) {
+		op = TRACE_OP(trace, i);
+		switch (op->type) {
+			case ALLOC:
+				t0 = fsecs_stamp();
+				p = use_libc ? malloc(op->size)
+					: OP_HINT(op) ? mm_malloc_hint(op->size, OP_HINT(op))
+					: mm_malloc(op->size);
+				t1 = fsecs_stamp();
+				if (p == NULL)
+					app_error("malloc failed in eval_requests");
+				trace->blocks[op->index] = p;
+				trace->block_sizes[op->index] = op->size;
+				break;
+
+			case REALLOC:
+				p = trace->blocks[op->index];
+				realloc_bytes += trace->block_sizes[op->index] < op->size
+					? trace->block_sizes[op->index] : op->size;
+				t0 = fsecs_stamp();
+				p = use_libc ? realloc(p, op->size) : mm_realloc(p, op->size);
+				t1 = fsecs_stamp();
+				if (p == NULL && op->size != 0)
+					app_error("realloc failed in eval_requests");
+				trace->blocks[op->index] = p;
+				trace->block_sizes[op->index] = op->size;
+				break;
+
+			case FREE:
+				p = op->index >= 0 ? trace->blocks[op->index] : NULL;
+				t0 = fsecs_stamp();
+				if (use_libc)
+					free(p);
+				else
+					mm_free(p);
+				t1 = fsecs_stamp();
+				if (op->index >= 0)
+					trace->blocks[op->index] = NULL;
+				break;
+
+			default:
+				app_error("Nonexistent request type in eval_requests");
+				return;
+		}
+		d = t1 - t0;
+		lat_add(&hist[op->type], d > ovhd ? d - ovhd : 0);
+	}
+	fsecs_unpin();
+
+	/* libc blocks are still live; give them back */
+	if (use_libc)
+		for (i = 0; i < trace->num_slots; i++)
+			free(trace->blocks[i]);
+
+	for (i = 0; i < 3; i++) {
+		stats->op_count[i] = hist[i].n;
+		stats->op_secs[i] = hist[i].sum * fsecs_tick();
+	}
+	stats->realloc_bytes = realloc_bytes;
+
+	if (report_latency && verbose) {
+		printf("%s latency %s (%s, less %llu for the clock):\n",
+				pkg, trace->filename, fsecs_tick_name(), ovhd);
+		printf("\t%-8s%10s%10s%10s%10s%10s%12s\n",
+				"op", "count", "p50", "p90", "p99", "p99.9", "max");
+		for (i = 0; i < 3; i++) {
+			if (hist[i].n == 0)
+				continue;
+			printf("\t%-8s%10llu%10llu%10llu%10llu%10llu%12llu\n",
+					names[i], hist[i].n,
+					lat_percentile(&hist[i], 0.5),
+					lat_percentile(&hist[i], 0.9),
+					lat_percentile(&hist[i], 0.99),
+					lat_percentile(&hist[i], 0.999),
+					hist[i].max);
+		}
 	}
+
+	if (latency_dump)
+		for (i = 0; i < 3; i++)
+			for (j = 0; j < LAT_NBUCKETS; j++)
+				if (hist[i].count[j])
+					fprintf(latency_dump, "%s,%s,%s,%llu,%llu,%llu\n",
+							pkg, trace->filename, names[i],
+							lat_lower(j), lat_upper(j), hist[i].count[j]);
 }
 
 /*************************************
@@ -1298,12 +2846,220 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/*
+ * eval_secs - time one of the xx_speed routines: the K-best cycle
+ *     count from fsecs, or, with -R, the median of robust_runs runs,
+ *     whose confidence interval and noise flag go into *stats
+ */
+static double eval_secs(fsecs_test_funct f, speed_t *params, stats_t *stats)
+{
+	double secs, noise;
+
+	if (robust_runs > 0) {
+		secs = fsecs_median(f, params, &stats->secs_lo, &stats->secs_hi,
+				&stats->noisy);
+	} else {
+		stats->noisy = 0;
+		secs = stats->secs_lo = stats->secs_hi = fsecs(f, params);
+	}
+
+	/* take out the time of the noise itself; if that leaves nothing,
+	   the replay's own time is lost in the noise's */
+	stats->noise_over = 0;
+	if (noise_buf) {
+		noise = fsecs(eval_noise_speed, params);
+		if (noise >= stats->secs_lo) {
+			stats->noise_over = 1;
+			return secs;
+		}
+		secs -= noise;
+		stats->secs_lo -= noise;
+		stats->secs_hi -= noise;
+	}
+	return secs;
+}
+
+/*
+ * eval_memctr - count the page faults and TLB misses (-M) of one replay
+ *     by an xx_speed routine, without the payload touches or the noise
+ *     of the timed runs. The mm heap is emptied of its pages first, so
+ *     every trace starts from the same state whatever ran before it;
+ *     libc's heap can't be, and keeps what the earlier passes left.
+ */
+static void eval_memctr(fsecs_test_funct f, speed_t *params, stats_t *stats,
+		int use_libc)
+{
+	int touch = touch_payloads;
+	char *noise = noise_buf;
+
+	touch_payloads = 0;
+	noise_buf = NULL;
+	if (!use_libc)
+		mem_release();
+	perfctr_start();
+	f(params);
+	perfctr_stop(&stats->memctr);
+	touch_payloads = touch;
+	noise_buf = noise;
+}
+
+/*
+ * eval_speedctr - count the CPU events (-E) of one more timed replay by
+ *     an xx_speed routine. The payload touches stay in, since they are
+ *     what the application would do; the noise of -x noise does not,
+ *     as its misses would be charged to the allocator.
+ */
+static void eval_speedctr(fsecs_test_funct f, speed_t *params, stats_t *stats)
+{
+	char *noise = noise_buf;
+
+	noise_buf = NULL;
+	perfctr_start();
+	f(params);
+	perfctr_stop(&stats->speedctr);
+	noise_buf = noise;
+}
+
+/*
+ * The payload-touching replay (-w). An application writes the blocks it
+ * gets and reads them before it lets them go; with -r it also goes back
+ * over all it holds now and then. The timed replays do the same, one
+ * word per cache line, so where the allocator puts blocks shows up in
+ * the time (and the cache misses of -E), not just what it costs to
+ * decide. block_sizes holds the size of each live block, 0 once freed.
+ */
+static void read_payload(const char *p, size_t size)
+{
+	unsigned x = 0;
+	size_t o;
+
+	for (o = 0; o < size; o += 64)
+		x += p[o];
+	touch_sink += x;
+}
+
+static void write_payload(char *p, size_t size)
+{
+	size_t o;
+
+	for (o = 0; o < size; o += 64)
+		p[o] = (char)o;
+}
+
+/* before the request: read the block it gives up */
+static void touch_before(trace_t *trace, const traceop_t *op)
+{
+	if (op->type == ALLOC || op->index < 0)
+		return;
+	read_payload(trace->blocks[op->index], trace->block_sizes[op->index]);
+	if (op->type == FREE)
+		trace->block_sizes[op->index] = 0;
+}
+
+/* after the request: write the block it got, and now and then reread
+   every live block */
+static void touch_after(trace_t *trace, int opnum, const traceop_t *op)
+{
+	int i;
+
+	if (op->type != FREE) {
+		write_payload(trace->blocks[op->index], op->size);
+		trace->block_sizes[op->index] = op->size;
+	}
+	if (reread_period > 0 && (opnum + 1) % reread_period == 0)
+		for (i = 0; i < trace->num_slots; i++)
+			if (trace->block_sizes[i])
+				read_payload(trace->blocks[i], trace->block_sizes[i]);
+}
+
+/*
+ * The noise mode (-x noise) stands in for the application code that
+ * runs between allocator calls: after each request, the replay touches
+ * the next noise_bytes of a buffer the size of the last-level cache, one
+ * line at a time, so the allocator's data is evicted at about the rate
+ * real code would evict it. The timing of the noise alone, by
+ * eval_noise_speed, is taken off the timed replays.
+ */
+static void init_noise(void)
+{
+	if ((noise_len = fsecs_cache_size(&noise_line)) == 0)
+		noise_len = 8 << 20;
+	if (noise_len > NOISE_MAX)
+		noise_len = NOISE_MAX;
+	if ((noise_buf = malloc(noise_len)) == NULL)
+		unix_error("noise_buf malloc in init_noise failed");
+	memset(noise_buf, 0, noise_len);
+	if (verbose)
+		printf("Touching %d bytes of a %zu KB buffer between requests.\n",
+				noise_bytes, noise_len >> 10);
+}
+
+static void pollute(void)
+{
+	int n;
+
+	for (n = 0; n < noise_bytes; n += noise_line) {
+		noise_buf[noise_pos]++;
+		if ((noise_pos += noise_line) >= noise_len)
+			noise_pos = 0;
+	}
+}
+
+/*
+ * eval_noise_speed - the noise of a replay of the trace, without the
+ *     replay
+ */
+static void eval_noise_speed(void *ptr)
+{
+	trace_t *trace = ((speed_t *)ptr)->trace;
+	int i;
+
+	for (i = 0; i < trace->num_ops; i++)
+		pollute();
+}
+
+/*
+ * thru_index - the throughput part of the performance index
+ */
+static double thru_index(double throughput)
+{
+	if (throughput < MIN_SPEED)
+		return 0.0;
+	if (throughput > MAX_SPEED)
+		return 1.0 - UTIL_WEIGHT;
+	return (throughput - MIN_SPEED) / (MAX_SPEED - MIN_SPEED) * (1.0 - UTIL_WEIGHT);
+}
+
+/*
+ * print_breakdown - print the Kops of each request type and the mean
+ *     bytes kept by a realloc ("-" for a type the trace doesn't use).
+ *     These count only the time inside the allocator, over one replay
+ *     rather than the best of several, so they don't add up to Kops.
+ */
+static void print_breakdown(const double *count, const double *secs,
+		double realloc_bytes)
+{
+	static const int order[3] = { ALLOC, FREE, REALLOC };
+	int j;
+
+	for (j = 0; j < 3; j++) {
+		if (count[order[j]] > 0 && secs[order[j]] > 0)
+			printf("%9.0f", (count[order[j]]/1e3)/secs[order[j]]);
+		else
+			printf("%9s", "-");
+	}
+	if (count[REALLOC] > 0)
+		printf("%7.0f ", realloc_bytes/count[REALLOC]);
+	else
+		printf("%7s ", "-");
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
 static void printresults(int n, stats_t *stats)
 {
-	int i;
+	int i, j;
 	/* weighted sums all */
 	double sumsecs = 0;
 	double sumops  = 0;
@@ -1311,32 +3067,109 @@ static void printresults(int n, stats_t *stats)
 	int sumweight = 0;
 
 	/* Print the individual results for each trace */
-	printf("  %6s%6s %5s%8s%12s  %s\n",
-			"valid", "util", "ops", "secs", "Kops", "trace");
+	double sumcount[3] = {0, 0, 0};
+	double sumopsecs[3] = {0, 0, 0};
+	double sumrbytes = 0;
+	double sumfrag = 0;
+
+	double sumlo = 0, sumhi = 0;
+
+	/* the breakdown does not come from the timed runs */
+	if (report_requests)
+		printf("malloc, free and realloc are Kops in one more run, "
+				"timed a request at a time.\n");
+	printf("  %6s%6s%6s %5s%8s%12s",
+			"valid", "util", "frag", "ops", "secs", "Kops");
+	if (robust_runs > 0)
+		printf("%8s", "+-%");
+	if (report_requests)
+		printf("%9s%9s%9s%7s  ", "malloc", "free", "realloc", "rcopy");
+	else
+		printf(" ");
+	if (report_memctr)
+		for (j = 0; j < PC_NMEMEVENTS; j++)
+			printf("%10s ", perfctr_name(j));
+	if (report_speedctr)
+		for (j = 0; j < PC_NEVENTS; j++)
+			printf("%8s ", perfctr_name(j));
+	printf("%s\n", "trace");
 	for (i=0; i < n; i++) {
 		if (stats[i].valid) {
-			printf("%2s%4s %5.0f%%%8.0f%10.6f%9.0f %s\n",
+			printf("%2s%4s %5.0f%%%5.0f%%%8.0f",
 					stats[i].weight != 0 ? "*" : "",
 					"yes",
 					stats[i].util*100.0,
-					stats[i].ops,
-					stats[i].secs,
-					(stats[i].ops/1e3)/stats[i].secs,
-					stats[i].filename);
+					stats[i].frag*100.0,
+					stats[i].ops);
+			/* no time at all if the noise swamped it */
+			if (stats[i].noise_over)
+				printf("%10s%9s ", "-", "-");
+			else
+				printf("%10.6f%9.0f ", stats[i].secs,
+						(stats[i].ops/1e3)/stats[i].secs);
+			/* half the confidence interval; ! if it is too wide */
+			if (robust_runs > 0 && stats[i].noise_over)
+				printf("%7s ", "-");
+			else if (robust_runs > 0)
+				printf("%6.1f%s ",
+						(stats[i].secs_hi - stats[i].secs_lo) / 2
+						/ stats[i].secs * 100,
+						stats[i].noisy ? "!" : " ");
+			if (report_requests)
+				print_breakdown(stats[i].op_count, stats[i].op_secs,
+						stats[i].realloc_bytes);
+			if (report_memctr)
+				for (j = 0; j < PC_NMEMEVENTS; j++) {
+					if (stats[i].memctr.valid[j])
+						printf("%10.0f ", stats[i].memctr.value[j]);
+					else
+						printf("%10s ", "-");
+				}
+			/* per request */
+			if (report_speedctr)
+				for (j = 0; j < PC_NEVENTS; j++) {
+					if (stats[i].speedctr.valid[j])
+						printf("%8.2f ", stats[i].speedctr.value[j] / stats[i].ops);
+					else
+						printf("%8s ", "-");
+				}
+			printf("%s\n", stats[i].filename);
 			sumweight += stats[i].weight;
-			sumsecs += stats[i].secs * stats[i].weight;
-			sumops += stats[i].ops * stats[i].weight;
+			if (!stats[i].noise_over) {
+				sumsecs += stats[i].secs * stats[i].weight;
+				sumlo += stats[i].secs_lo * stats[i].weight;
+				sumhi += stats[i].secs_hi * stats[i].weight;
+				sumops += stats[i].ops * stats[i].weight;
+			}
 			sumutil += stats[i].util * stats[i].weight;
+			sumfrag += stats[i].frag * stats[i].weight;
+			for (j = 0; j < 3; j++) {
+				sumcount[j] += stats[i].op_count[j] * stats[i].weight;
+				sumopsecs[j] += stats[i].op_secs[j] * stats[i].weight;
+			}
+			sumrbytes += stats[i].realloc_bytes * stats[i].weight;
 		}
 		else {
-			printf("%2s%4s %6s%8s%9s%9s %s\n",
+			/* a "-" in every column the valid rows have */
+			printf("%2s%4s %6s%6s%8s%10s%9s ",
 					stats[i].weight != 0 ? "*" : "",
 					"no",
 					"-",
 					"-",
 					"-",
 					"-",
-					stats[i].filename);
+					"-");
+			if (robust_runs > 0)
+				printf("%7s ", "-");
+			if (report_requests)
+				printf("%9s%9s%9s%7s ", "-", "-", "-", "-");
+			if (report_memctr)
+				for (j = 0; j < PC_NMEMEVENTS; j++)
+					printf("%10s ", "-");
+			if (report_speedctr)
+				for (j = 0; j < PC_NEVENTS; j++)
+					printf("%8s ", "-");
+			printf("%s\n", stats[i].filename);
 		}
 	}
 
@@ -1344,12 +3177,19 @@ static void printresults(int n, stats_t *stats)
 	if (errors == 0) {
 		if(sumweight == 0) sumweight = 1;
 
-		printf("%2d     %5.0f%%%8.0f%10.6f%9.0f\n",
+		printf("%2d     %5.0f%%%5.0f%%%8.0f%10.6f%9.0f ",
 				sumweight,
 				(sumutil/(double)sumweight)*100.0,
+				(sumfrag/(double)sumweight)*100.0,
 				sumops,
 				sumsecs,
 				(sumsecs==0.0) ? 0 : (sumops/1e3)/sumsecs);
+		if (robust_runs > 0)
+			printf("%6.1f  ", sumsecs == 0.0 ? 0 : (sumhi - sumlo) / 2
+					/ sumsecs * 100);
+		if (report_requests)
+			print_breakdown(sumcount, sumopsecs, sumrbytes);
+		printf("\n");
 	}
 	else {
 		printf("       %8s%10s%6s\n",
@@ -1400,6 +3240,21 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 	va_end(ap);
 }
 
+/*
+ * init_heap - Initialize the simulated memory system in memlib.c
+ */
+static void init_heap(void)
+{
+	if (use_hugepages) {
+		if (mem_init_huge() < 0)
+			app_error("huge pages are not available on this system\n");
+		if (verbose)
+			printf("Using huge pages for the mm heap.\n");
+	}
+	else
+		mem_init();
+}
+
 /*
  * usage - Explain the command line arguments
  */
@@ -1409,6 +3264,7 @@ static void usage(void)
 	fprintf(stderr, "Options\n");
 	fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
 	fprintf(stderr, "\t-D         Equivalent to -d2.\n");
+	fprintf(stderr, "\t-K <n>     With -D, check the whole heap every <n> requests.\n");
 	fprintf(stderr, "\t-c <file>  Run trace file <file> once, check for correctness only.\n");
 	fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
 	fprintf(stderr, "\t-h         Print this message.\n");
@@ -1418,4 +3274,30 @@ static void usage(void)
 	fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
 	fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
 	fprintf(stderr, "\t-j         Use <stdin> as the trace file.\n");
+	fprintf(stderr, "\t-H         Back the mm heap with huge pages.\n");
+	fprintf(stderr, "\t-M         Report page faults and TLB misses per trace.\n");
+	fprintf(stderr, "\t-E         Report instructions, cache, TLB and branch misses per request.\n");
+	fprintf(stderr, "\t-I         Ignore lifetime hints in the trace files.\n");
+	fprintf(stderr, "\t-B <file>  Write the trace in binary (.repb) to <file> and exit.\n");
+	fprintf(stderr, "\t-S         Stream the traces instead of loading them.\n");
+	fprintf(stderr, "\t-C         Cache parsed traces as <trace>.repb next to them.\n");
+	fprintf(stderr, "\t-P <n>     Check traces in <n> processes; time them one by one.\n");
+	fprintf(stderr, "\t-T         Also time each trace replayed on its own threads.\n");
+	fprintf(stderr, "\t-b <name>  Run benchmark larson, threadtest, xmalloc or all instead.\n");
+	fprintf(stderr, "\t-N <n>     Run the benchmarks on 1 to <n> threads (default 4).\n");
+	fprintf(stderr, "\t-X         Check the persistent heap, region, pool and heap check interfaces and exit.\n");
+	fprintf(stderr, "\t-O         Also time malloc, free and realloc on their own, in one more run.\n");
+	fprintf(stderr, "\t-L         Print latency percentiles per request type and trace (implies -O).\n");
+	fprintf(stderr, "\t-G <file>  With -L, also write the latency histograms to <file> (CSV).\n");
+	fprintf(stderr, "\t-m <name>  Time with fcyc (cycle counter), itimer, gettod or clock.\n");
+	fprintf(stderr, "\t-p <cpu>   Time on core <cpu> (-m clock: the current one).\n");
+	fprintf(stderr, "\t-x <mode>  Time with cold caches (default), warm ones, or noise between requests.\n");
+	fprintf(stderr, "\t-n <n>     With -x noise, touch <n> bytes between requests (default 4096).\n");
+	fprintf(stderr, "\t-w         Write each payload when allocated and read it before it is freed (implies -E).\n");
+	fprintf(stderr, "\t-r <n>     With -w, also read every live payload every <n> requests.\n");
+	fprintf(stderr, "\t-R <n>     Time by the median of <n> runs, with a confidence interval.\n");
+	fprintf(stderr, "\t-W <n>     With -R, make <n> unmeasured runs first (default 2).\n");
+	fprintf(stderr, "\t-Q <pct>   With -R, flag intervals wider than +-<pct>%% of the median (default 5).\n");
+	fprintf(stderr, "\t-F <file>  Write the free space over time in the util pass to <file> (CSV).\n");
+	fprintf(stderr, "\t-k <n>     Sample the free space every <n> requests (default %d).\n", FRAG_PERIOD);
 }
\ No newline at end of file
@@ -15,10 +15,14 @@
 #include "memlib.h"
 #include "config.h"
 
+/* huge page size the heap is aligned to and grown by in mem_init_huge */
+#define HUGEPAGE_SIZE (1<<21)	/* 2 MB */
+
 /* private variables */
 static char *heap;
 static char *mem_brk;
 static char *mem_max_addr;
+static size_t huge_size = 0;	/* HUGEPAGE_SIZE if the heap has huge pages */
 
 /* 
  * mem_init - initialize the memory system model
@@ -35,6 +39,87 @@ void mem_init(void){
 	mem_brk = heap;					/* heap is empty initially */
 }
 
+/*
+ * mem_init_huge - initialize the memory system model with a heap backed
+ *		by huge pages. MAP_HUGETLB is tried first; if the system has no
+ *		huge pages reserved we fall back to a HUGEPAGE_SIZE-aligned
+ *		mapping with MADV_HUGEPAGE, i.e. transparent huge pages.
+ *		Returns 0 on success and -1 if neither is available.
+ */
+int mem_init_huge(void){
+	size_t len = (MAX_HEAP + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+	char *p;
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		goto done;
+#endif
+#ifdef MADV_HUGEPAGE
+	/* over-reserve, then trim both ends back to a huge page boundary */
+	p = mmap(NULL, len + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED) {
+		char *aligned = (char *)(((size_t)p + HUGEPAGE_SIZE - 1)
+				& ~(size_t)(HUGEPAGE_SIZE - 1));
+		if (aligned > p)
+			munmap(p, aligned - p);
+		munmap(aligned + len, (p + len + HUGEPAGE_SIZE) - (aligned + len));
+		p = aligned;
+		if (madvise(p, len, MADV_HUGEPAGE) == 0)
+			goto done;
+		munmap(p, len);
+	}
+#endif
+	return -1;
+
+done:
+	heap = p;
+	huge_size = HUGEPAGE_SIZE;
+	mem_max_addr = heap + MAX_HEAP;
+	mem_brk = heap;
+	return 0;
+}
+
+/*
+ * mem_init_file - initialize the memory system model on top of the file
+ *		at path, so that the heap survives the process. The file is
+ *		created (sparse, MAX_HEAP bytes) if needed; the brk starts at the
+ *		bottom and it is up to the allocator to restore it with mem_sbrk.
+ *		Returns 0 on success and -1 on error.
+ */
+int mem_init_file(const char *path){
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, MAX_HEAP) < 0) {
+		close(fd);
+		return -1;
+	}
+	heap = mmap((void *)0x800000000, /* suggested start*/
+			MAX_HEAP,				/* length */
+			PROT_READ | PROT_WRITE,	/* permissions */
+			MAP_SHARED,				/* writes go back to the file */
+			fd,						/* fd */
+			0);						/* offset */
+	close(fd);
+	if (heap == MAP_FAILED)
+		return -1;
+	mem_max_addr = heap + MAX_HEAP;
+	mem_brk = heap;
+	return 0;
+}
+
+/*
+ * mem_sync - flush the part of a file-backed heap below the brk to disk
+ */
+int mem_sync(void){
+	if (mem_brk == heap)
+		return 0;
+	return msync(heap, mem_brk - heap, MS_SYNC);
+}
+
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
@@ -49,6 +134,15 @@ void mem_reset_brk(){
 	mem_brk = heap;
 }
 
+/*
+ * mem_release - reset the brk and hand the heap's pages back to the
+ *		system, so that the next run faults them in afresh
+ */
+void mem_release(void){
+	madvise(heap, MAX_HEAP, MADV_DONTNEED);
+	mem_brk = heap;
+}
+
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
  *		by incr bytes and returns the start address of the new area. In
@@ -87,6 +181,14 @@ size_t mem_heapsize() {
 	return (size_t)((void *)mem_brk - (void *)heap);
 }
 
+/*
+ * mem_hugepagesize() - returns the huge page size the heap should grow
+ *		by, or 0 if the heap is not backed by huge pages
+ */
+size_t mem_hugepagesize(){
+	return huge_size;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -12,7 +12,7 @@ footer (4 byte) + (size | l_alloc | alloc)
 The structure of free list:
 
 I have RANGE_SIZE size of free_list
-head_listp[i] is the i-th free list head pointer
+HEAD(i) is the i-th free list head pointer
 my range: RANGE is a constant
 [INITIAL_SIZE, RANGE]
 (RANGE, RANGE * 2]
@@ -21,6 +21,28 @@ my range: RANGE is a constant
 ...
 (RANGE * 2^RANGE_SIZE, +infty)
 
+Lifetime classes:
+
+there is one such set of RANGE_SIZE lists for each lifetime hint
+(MM_HINT_NONE, MM_HINT_SHORT, ...), so HEAD(hint * RANGE_SIZE + i).
+Blocks of a hinted class live on pages of their own: the heap is grown
+for them in whole CLASS_PAGE pages, page_class records which class owns
+each page, and coalesce never merges across two classes. Short-lived
+churn therefore cannot fragment the pages holding long-lived blocks.
+
+The root block:
+
+the first ROOT_SIZE bytes of the heap hold everything needed to resume
+the allocator, stored as offsets so they do not depend on where the heap
+is mapped:
+magic    (4 byte) : ROOT_MAGIC once mm_init has finished
+epilogue (4 byte) : the offset of the epilogue block
+user     (4 byte) : the offset of the block set by mm_set_root
+bins     (4 byte * NBINS) : the free list heads
+so a heap living in a file (mem_init_file) can be picked up again by
+mm_open without rebuilding anything. page_class is not kept in the
+heap, so after mm_open blocks freed on old pages go to MM_HINT_NONE.
+
  */
 #include <assert.h>
 #include <stdio.h>
@@ -30,6 +52,7 @@ my range: RANGE is a constant
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 /* If you want debugging output, use the following macro.  When you hand
  * in, remove the #define DEBUG line. */
@@ -103,10 +126,40 @@ my range: RANGE is a constant
 /* constant about segregated fit */
 #define RANGE_SIZE          (20)
 #define RANGE               (48)
+#define NBINS               (MM_NHINTS * RANGE_SIZE)
+
+/* constant about lifetime classes */
+#define CLASS_SHIFT         (12)
+#define CLASS_PAGE          (1<<CLASS_SHIFT)
+#define PAGE_ROUND(off)     (((off) + CLASS_PAGE - 1) & ~(size_t)(CLASS_PAGE - 1))
+
+/* layout of the root block */
+#define ROOT_MAGIC          (0x6d6d6870) /* "mmhp" */
+#define ROOT_EPI            (1*WSIZE)
+#define ROOT_USER           (2*WSIZE)
+#define ROOT_BINS           (3*WSIZE)
+#define ROOT_SIZE           ALIGN(ROOT_BINS + NBINS*WSIZE)
+
+/* read and write the head pointer of the id-th free list */
+#define HEAD(id)            GET_PTR(root_p + ROOT_BINS + (id)*WSIZE)
+#define SET_HEAD(id, bp)    PUT_PTR(root_p + ROOT_BINS + (id)*WSIZE, bp)
 
+static char *root_p = 0; /* the pointer to the root block */
 static char *heap_listp = 0; /* the pointer to the prologue block */
 static char *epilogue = 0; /* the pointer to the epilogue block */
-static char *head_listp[RANGE_SIZE]; /* the head pointers of the lists about segregated fit */
+
+static unsigned char page_class[MAX_HEAP >> CLASS_SHIFT]; /* the class owning each page */
+static size_t class_pages = 0; /* pages below this may have a hinted class */
+
+/* the blocks changed by the latest calls, for mm_checkheap_incremental */
+#define TOUCH_RING          (8)
+static char *touched[TOUCH_RING];
+static unsigned ntouched = 0;
+#define TOUCH(bp)           (touched[ntouched++ % TOUCH_RING] = (char *)(bp))
+
+/* the lifetime class of the block at bp */
+#define CLASS_OF(bp)        (class_pages ? \
+                             page_class[((char *)(bp) - root_p) >> CLASS_SHIFT] : MM_HINT_NONE)
 
 /* given the size of the block, 
    returns the index of the list in which the block is located */
@@ -121,11 +174,12 @@ static size_t get_range(size_t size){
 
 /* adds a block to a linked list */
 static void add_into_list(void *bp){
-    size_t id = get_range(GET_SIZE(HDRP(bp)));
+    size_t id = CLASS_OF(bp) * RANGE_SIZE + get_range(GET_SIZE(HDRP(bp)));
+    char *head = HEAD(id);
     PUT_PTR(PRED(bp), 0);
-    PUT_PTR(SUCC(bp), head_listp[id]);
-    PUT_PTR(PRED(head_listp[id]), bp);
-    head_listp[id] = bp;
+    PUT_PTR(SUCC(bp), head);
+    PUT_PTR(PRED(head), bp);
+    SET_HEAD(id, bp);
 }
 
 /* deletes a block to a linked list */
@@ -134,16 +188,23 @@ static void delete_from_list(void *bp){
     PUT_PTR(PRED(SUCC_PTR(bp)), PRED_PTR(bp));
     if (!PRED_PTR(bp)){
         size_t id = get_range(GET_SIZE(HDRP(bp)));
-        head_listp[id] = SUCC_PTR(bp);
+        while (HEAD(id) != bp && id + RANGE_SIZE < NBINS)
+            id += RANGE_SIZE;
+        SET_HEAD(id, SUCC_PTR(bp));
     }
 }
 
 /* see if it can merge with the two blocks adjacent to the address */
 static void *coalesce(void *bp){
-    unsigned prev_alloc = GET_L_ALLOC(HDRP(bp));
-    unsigned next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    int cls = CLASS_OF(bp);
+    unsigned prev_alloc = GET_L_ALLOC(HDRP(bp))
+                          || CLASS_OF(PREV_BLKP(bp)) != cls;
+    unsigned next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)))
+                          || CLASS_OF(NEXT_BLKP(bp)) != cls;
     size_t size = GET_SIZE(HDRP(bp));
     
+    /* the block in front of the result keeps its own l_alloc bit: it may
+       be free when it belongs to another lifetime class */
     if (prev_alloc && next_alloc){
         add_into_list(bp);
         return bp;
@@ -153,8 +214,8 @@ static void *coalesce(void *bp){
         
         delete_from_list(NEXT_BLKP(bp));
 
-        PUT(HDRP(bp), PACK(size, 2));
-        PUT(FTRP(bp), PACK(size, 2));
+        PUT(HDRP(bp), PACK(size, GET_L_ALLOC(HDRP(bp))));
+        PUT(FTRP(bp), PACK(size, GET_L_ALLOC(HDRP(bp))));
 
         add_into_list(bp);
     }
@@ -164,8 +225,8 @@ static void *coalesce(void *bp){
         delete_from_list(PREV_BLKP(bp));
 
         bp = PREV_BLKP(bp);
-        PUT(HDRP(bp), PACK(size, 2));
-        PUT(FTRP(bp), PACK(size, 2));
+        PUT(HDRP(bp), PACK(size, GET_L_ALLOC(HDRP(bp))));
+        PUT(FTRP(bp), PACK(size, GET_L_ALLOC(HDRP(bp))));
 
         add_into_list(bp);
     }
@@ -177,22 +238,37 @@ static void *coalesce(void *bp){
         delete_from_list(NEXT_BLKP(bp));
         
         bp = PREV_BLKP(bp);
-        PUT(HDRP(bp), PACK(size, 2));
-        PUT(FTRP(bp), PACK(size, 2));
+        PUT(HDRP(bp), PACK(size, GET_L_ALLOC(HDRP(bp))));
+        PUT(FTRP(bp), PACK(size, GET_L_ALLOC(HDRP(bp))));
 
         add_into_list(bp);
     }
     return bp;
 }
 
-/* expand the heap when it runs out of space */
-static void *extend_heap(size_t words){
+/* expand the heap when it runs out of space; the new block belongs to class cls */
+static void *extend_heap(size_t words, int cls){
     char *bp;
-    size_t size;
+    size_t size, brk, pad, page;
 
     size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
+    if (cls != MM_HINT_NONE){
+        /* start and end on a page boundary so the pages are cls's alone */
+        brk = epilogue - root_p;
+        pad = PAGE_ROUND(brk) - brk;
+        if (pad && pad < INITSIZE) pad += CLASS_PAGE;
+        if (pad && extend_heap(pad / WSIZE, MM_HINT_NONE) == NULL)
+            return NULL;
+        size = PAGE_ROUND(size);
+    }
     if ((long)(bp = mem_sbrk(size)) == -1)
         return NULL;
+    if (cls != MM_HINT_NONE){
+        for (page = (bp - root_p) >> CLASS_SHIFT;
+             page < ((bp - root_p) + size) >> CLASS_SHIFT; page++)
+            page_class[page] = cls;
+        class_pages = MAX(class_pages, page);
+    }
     
     PUT(HDRP(bp), PACK(size, GET_L_ALLOC(HDRP(bp))));
     PUT(FTRP(bp), PACK(size, GET_L_ALLOC(HDRP(bp))));
@@ -200,6 +276,7 @@ static void *extend_heap(size_t words){
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
 
     epilogue = NEXT_BLKP(bp);
+    PUT_PTR(root_p + ROOT_EPI, epilogue);
 
     return coalesce(bp);
 }
@@ -208,10 +285,12 @@ static void *extend_heap(size_t words){
  * mm_init - Called when a new trace starts.
  */
 int mm_init(void){
-    for (size_t i = 0; i < RANGE_SIZE; i++)
-        head_listp[i] = 0;
-    if ((heap_listp = mem_sbrk(6*WSIZE)) == (void *)-1)
+    memset(page_class, 0, class_pages);
+    class_pages = 0;
+    ntouched = 0;
+    if ((root_p = mem_sbrk(ROOT_SIZE + 6*WSIZE)) == (void *)-1)
         return -1;
+    heap_listp = root_p + ROOT_SIZE;
     PUT(heap_listp, 0);
     PUT(heap_listp + (1*WSIZE), PACK(INITSIZE, 3));
     heap_listp += (2*WSIZE);
@@ -219,15 +298,79 @@ int mm_init(void){
     PUT_PTR(heap_listp + (1*WSIZE), 0);
     PUT(heap_listp + (2*WSIZE), PACK(INITSIZE, 3));
     PUT(heap_listp + (3*WSIZE), PACK(0, 3));
+    epilogue = heap_listp + (4*WSIZE);
+
+    for (size_t i = 0; i < NBINS; i++)
+        SET_HEAD(i, 0);
+    PUT_PTR(root_p + ROOT_EPI, epilogue);
+    PUT_PTR(root_p + ROOT_USER, 0);
+    PUT(root_p, ROOT_MAGIC);
 
     return 0;
 }
 
-/* given the desired size, find a suitable block or return one that cannot be found */
-static void *find_fit(size_t asize){
-    size_t id = get_range(asize);
-    while(id < RANGE_SIZE){
-        char* bp = head_listp[id];
+/*
+ * mm_open - Resume the allocator on a heap that already holds the state
+ *      of an earlier mm_init (e.g. one mapped with mem_init_file).
+ *      Only the brk is restored, so this is O(1); if validate is set the
+ *      heap is also run through the mm_checkheap invariants first.
+ *      Returns -1 if there is no usable heap, or its root block is bad.
+ */
+int mm_open(int validate){
+    char *lo = mem_heap_lo();
+    size_t top;
+
+    if (GET(lo) != ROOT_MAGIC)
+        return -1;
+    memset(page_class, 0, class_pages);
+    class_pages = 0;
+    ntouched = 0;
+    root_p = lo;
+    heap_listp = root_p + ROOT_SIZE + (2*WSIZE);
+    epilogue = GET_PTR(root_p + ROOT_EPI);
+
+    /* give the heap back everything up to and including the epilogue
+       header, if the saved offset can be the end of a heap at all */
+    top = (size_t)(epilogue - lo);
+    if ((top & (ALIGNMENT-1)) || top < ROOT_SIZE || top > MAX_HEAP)
+        return -1;
+    mem_reset_brk();
+    if (mem_sbrk(top) == (void *)-1)
+        return -1;
+
+    if (validate && mm_validate(MM_CHECK_ALL, NULL) < 0){
+        mem_reset_brk();
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * mm_checkpoint - Flush a file-backed heap. All of the allocator state
+ *      lives in the heap, so there is nothing else to save.
+ */
+int mm_checkpoint(void){
+    return mem_sync();
+}
+
+/*
+ * mm_set_root, mm_get_root - A single user pointer kept in the root block,
+ *      so that a reopened heap has somewhere to start from.
+ */
+void mm_set_root(void *ptr){
+    PUT_PTR(root_p + ROOT_USER, ptr);
+}
+
+void *mm_get_root(void){
+    return GET_PTR(root_p + ROOT_USER);
+}
+
+/* given the desired size, find a suitable block of class cls
+   or return one that cannot be found */
+static void *find_fit(size_t asize, int cls){
+    size_t id = cls * RANGE_SIZE + get_range(asize);
+    while(id < (size_t)(cls + 1) * RANGE_SIZE){
+        char* bp = HEAD(id);
         while(bp){
             size_t size = GET_SIZE(HDRP(bp));
             if (size >= asize) return bp;
@@ -238,6 +381,19 @@ static void *find_fit(size_t asize){
     return NULL;
 }
 
+/* how much to extend the heap by to get a block of asize:
+   CHUNKSIZE at least, or up to the next huge page boundary when the
+   heap is backed by huge pages */
+static size_t grow_size(size_t asize){
+    size_t huge = mem_hugepagesize();
+    size_t extendsize = MAX(asize, CHUNKSIZE);
+    if (huge){
+        size_t brk = (char *)epilogue - (char *)mem_heap_lo();
+        extendsize = ((brk + extendsize + huge - 1) & ~(huge - 1)) - brk;
+    }
+    return extendsize;
+}
+
 /* for blocks starting with bp, to allocate the space of asize */
 static void place(void *bp, size_t asize){
     size_t size = GET_SIZE(HDRP(bp));
@@ -265,11 +421,8 @@ static void place(void *bp, size_t asize){
     }
 }
 
-/*
- * malloc - Allocate a block by incrementing the brk pointer.
- *      Always allocate a block whose size is a multiple of the alignment.
- */
-void *malloc(size_t size){
+/* allocate a block of class cls, from its own lists or from new heap */
+static void *alloc_class(size_t size, int cls){
     size_t asize;
     size_t extendsize;
     char *bp;
@@ -278,18 +431,37 @@ void *malloc(size_t size){
     
     asize = ALIGN(MAX(size + WSIZE, INITSIZE));
 
-    if ((bp = find_fit(asize)) != NULL){
+    if ((bp = find_fit(asize, cls)) != NULL){
         place(bp, asize);
+        TOUCH(bp);
         return bp;
     }
 
-    extendsize = MAX(asize, CHUNKSIZE);
-    if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
+    extendsize = grow_size(asize);
+    if ((bp = extend_heap(extendsize/WSIZE, cls)) == NULL)
         return NULL;
     place(bp, asize);
+    TOUCH(bp);
     return bp;
 }
 
+/*
+ * malloc - Allocate a block by incrementing the brk pointer.
+ *      Always allocate a block whose size is a multiple of the alignment.
+ */
+void *malloc(size_t size){
+    return alloc_class(size, MM_HINT_NONE);
+}
+
+/*
+ * mm_malloc_hint - Like malloc, but the block is kept with others that
+ *      are expected to live about as long (one of the MM_HINT_* classes).
+ */
+void *mm_malloc_hint(size_t size, int hint){
+    if (hint < 0 || hint >= MM_NHINTS) hint = MM_HINT_NONE;
+    return alloc_class(size, hint);
+}
+
 /*
  * free - We know how to free a block.  So we do not ignore this call.
  */
@@ -304,7 +476,7 @@ void free(void *bp){
         PACK(GET_SIZE(HDRP(NEXT_BLKP(bp))),
              GET_ALLOC(HDRP(NEXT_BLKP(bp)))));
 
-    coalesce(bp);
+    TOUCH(coalesce(bp));
 }
 
 /*
@@ -327,7 +499,7 @@ void *realloc(void *oldptr, size_t size){
         return malloc(size);
     }
 
-    newptr = malloc(size);
+    newptr = alloc_class(size, CLASS_OF(oldptr));
 
     /* If realloc() fails the original block is left untouched  */
     if(!newptr) {
@@ -359,9 +531,481 @@ void *calloc (size_t nmemb, size_t size){
 }
 
 /*
- 
+ * alloc_aligned - Allocate size bytes whose address is a multiple of
+ *      align (a power of two). We over-allocate, free the part in front
+ *      of the aligned address and let place() trim the tail.
+ */
+static void *alloc_aligned(size_t align, size_t size){
+    size_t asize = ALIGN(MAX(size + WSIZE, INITSIZE));
+    size_t bsize, lead;
+    unsigned l_alloc;
+    char *bp, *ap;
+
+    if (align <= ALIGNMENT) return malloc(size);
+    if ((bp = malloc(size + align + INITSIZE)) == NULL) return NULL;
+    if (((size_t)bp & (align - 1)) == 0) ap = bp;
+    else ap = (char *)(((size_t)bp + INITSIZE + align - 1) & ~(align - 1));
+
+    if (ap != bp){
+        /* split [bp, ap) off as a free block */
+        bsize = GET_SIZE(HDRP(bp));
+        l_alloc = GET_L_ALLOC(HDRP(bp));
+        lead = ap - bp;
+        PUT(HDRP(bp), PACK(lead, l_alloc));
+        PUT(FTRP(bp), PACK(lead, l_alloc));
+        PUT(HDRP(ap), PACK(bsize - lead, 1));
+        coalesce(bp);
+    }
+    place(ap, asize);
+    return ap;
+}
+
+/*
+ * Regions: objects that all die together are bump-allocated out of
+ * chunks taken from the heap with malloc, and the whole region is given
+ * back chunk by chunk, so nothing is ever freed one object at a time.
+ *
+ * Each chunk starts with a region_chunk_t linking it to the chunk
+ * before it; the region always allocates from the newest chunk.
+ */
+#define REGION_CHUNK        (1<<12)
+
+typedef struct region_chunk {
+    struct region_chunk *prev;  /* the chunk allocated before this one */
+    char *end;                  /* first byte past this chunk */
+} region_chunk_t;
+
+struct mm_region {
+    region_chunk_t *chunk;      /* the current chunk */
+    char *cur;                  /* next free byte in the current chunk */
+};
+
+/*
+ * mm_region_create - Make an empty region; its first chunk is taken
+ *      on the first mm_region_alloc.
+ */
+mm_region_t *mm_region_create(void){
+    mm_region_t *r = malloc(sizeof(mm_region_t));
+    if (r){
+        r->chunk = NULL;
+        r->cur = NULL;
+    }
+    return r;
+}
+
+/*
+ * mm_region_alloc - Allocate size bytes from the region by bumping a
+ *      pointer, taking a new chunk from the heap when this one is full.
+ */
+void *mm_region_alloc(mm_region_t *r, size_t size){
+    size_t asize = ALIGN(size);
+    char *bp;
+
+    if (size == 0) return NULL;
+
+    if (!r->chunk || asize > (size_t)(r->chunk->end - r->cur)){
+        size_t csize = MAX(REGION_CHUNK, ALIGN(sizeof(region_chunk_t)) + asize);
+        region_chunk_t *c = malloc(csize);
+        if (!c) return NULL;
+        c->prev = r->chunk;
+        c->end = (char *)c + csize;
+        r->chunk = c;
+        r->cur = (char *)c + ALIGN(sizeof(region_chunk_t));
+    }
+    bp = r->cur;
+    r->cur += asize;
+    return bp;
+}
+
+/*
+ * mm_region_mark - Remember how far the region has been allocated
+ */
+mm_region_mark_t mm_region_mark(mm_region_t *r){
+    mm_region_mark_t m;
+    m.chunk = r->chunk;
+    m.cur = r->cur;
+    return m;
+}
+
+/*
+ * mm_region_rewind - Release everything allocated since mark m: chunks
+ *      taken after the mark go back to the heap and the bump pointer is
+ *      moved back to where it was.
+ */
+void mm_region_rewind(mm_region_t *r, mm_region_mark_t m){
+    while (r->chunk != m.chunk){
+        region_chunk_t *prev = r->chunk->prev;
+        free(r->chunk);
+        r->chunk = prev;
+    }
+    r->cur = m.cur;
+}
+
+/*
+ * mm_region_destroy - Give every chunk of the region back to the heap
+ */
+void mm_region_destroy(mm_region_t *r){
+    mm_region_mark_t empty = { NULL, NULL };
+    mm_region_rewind(r, empty);
+    free(r);
+}
+
+/*
+ * Pools: fixed-size objects carved out of runs, blocks of runsize bytes
+ * aligned to runsize, so the run of any object is found by masking its
+ * address. A run starts with a pool_run_t and keeps freed objects on an
+ * intrusive list; objects never handed out yet are taken by bumping.
+ * Runs with a free object are on the pool's avail list, full ones on
+ * its full list. Objects carry no header of their own.
+ */
+#define POOL_RUN            (1<<12)
+#define POOL_MIN_OBJS       (16)
+
+typedef struct pool_run {
+    struct pool_run *prev;      /* neighbours on the avail or full list */
+    struct pool_run *next;
+    void *free;                 /* freed objects in this run */
+    char *bump;                 /* first object never handed out */
+    size_t nused;               /* live objects in this run */
+} pool_run_t;
+
+struct mm_pool {
+    size_t objsize;             /* object size, rounded up to align */
+    size_t first;               /* offset of the first object in a run */
+    size_t runsize;             /* bytes per run, a power of two */
+    size_t perrun;              /* objects per run */
+    pool_run_t *avail;          /* runs with at least one free object */
+    pool_run_t *full;           /* runs with none */
+    mm_pool_stats_t stats;
+};
+
+static void run_unlink(pool_run_t **list, pool_run_t *run){
+    if (run->prev) run->prev->next = run->next;
+    else *list = run->next;
+    if (run->next) run->next->prev = run->prev;
+}
+
+static void run_push(pool_run_t **list, pool_run_t *run){
+    run->prev = NULL;
+    run->next = *list;
+    if (*list) (*list)->prev = run;
+    *list = run;
+}
+
+/*
+ * mm_pool_create - Make a pool of objsize-byte objects aligned to align
+ */
+mm_pool_t *mm_pool_create(size_t objsize, size_t align){
+    mm_pool_t *pool;
+    size_t runsize = POOL_RUN;
+
+    if (align < ALIGNMENT) align = ALIGNMENT;
+    if (align & (align - 1)) return NULL;
+    if (objsize < sizeof(void *)) objsize = sizeof(void *);
+    objsize = (objsize + align - 1) & ~(align - 1);
+
+    if ((pool = malloc(sizeof(mm_pool_t))) == NULL) return NULL;
+    pool->objsize = objsize;
+    pool->first = (sizeof(pool_run_t) + align - 1) & ~(align - 1);
+    while (runsize < pool->first + POOL_MIN_OBJS * objsize)
+        runsize <<= 1;
+    pool->runsize = runsize;
+    pool->perrun = (runsize - pool->first) / objsize;
+    pool->avail = NULL;
+    pool->full = NULL;
+    memset(&pool->stats, 0, sizeof(pool->stats));
+    pool->stats.objsize = objsize;
+    return pool;
+}
+
+/*
+ * mm_pool_alloc - Hand out one object, taking a new run if none has room
+ */
+void *mm_pool_alloc(mm_pool_t *pool){
+    pool_run_t *run = pool->avail;
+    void *obj;
+
+    if (!run){
+        if ((run = alloc_aligned(pool->runsize, pool->runsize)) == NULL)
+            return NULL;
+        run->free = NULL;
+        run->bump = (char *)run + pool->first;
+        run->nused = 0;
+        run_push(&pool->avail, run);
+        pool->stats.runs++;
+    }
+
+    if (run->free){
+        obj = run->free;
+        run->free = *(void **)obj;
+    }
+    else{
+        obj = run->bump;
+        run->bump += pool->objsize;
+    }
+    if (++run->nused == pool->perrun){
+        run_unlink(&pool->avail, run);
+        run_push(&pool->full, run);
+    }
+    pool->stats.live++;
+    pool->stats.allocs++;
+    return obj;
+}
+
+/*
+ * mm_pool_free - Give an object back to its run. A run that becomes empty
+ *      is released to the heap, unless it is the only run with room left.
+ */
+void mm_pool_free(mm_pool_t *pool, void *obj){
+    pool_run_t *run;
+
+    if (!obj) return;
+    run = (pool_run_t *)((size_t)obj & ~(pool->runsize - 1));
+
+    if (run->nused-- == pool->perrun){
+        run_unlink(&pool->full, run);
+        run_push(&pool->avail, run);
+    }
+    *(void **)obj = run->free;
+    run->free = obj;
+    pool->stats.live--;
+    pool->stats.frees++;
+
+    if (run->nused == 0 && (run->prev || run->next)){
+        run_unlink(&pool->avail, run);
+        free(run);
+        pool->stats.runs--;
+    }
+}
+
+/*
+ * mm_pool_stats - Copy out the pool's counters
+ */
+void mm_pool_stats(mm_pool_t *pool, mm_pool_stats_t *stats){
+    *stats = pool->stats;
+    stats->bytes = pool->stats.runs * pool->runsize;
+}
+
+/*
+ * mm_pool_destroy - Release every run of the pool, live objects or not
+ */
+void mm_pool_destroy(mm_pool_t *pool){
+    pool_run_t *run, *next;
+
+    for (run = pool->avail; run; run = next){
+        next = run->next;
+        free(run);
+    }
+    for (run = pool->full; run; run = next){
+        next = run->next;
+        free(run);
+    }
+    free(pool);
+}
+
+/*
+ * mm_heap_stats - Count the free blocks and their bytes, and find the
+ *      largest, walking the heap from the prologue to the epilogue
+ */
+void mm_heap_stats(mm_heap_stats_t *stats){
+    size_t size;
+    char *bp;
+
+    stats->free_bytes = 0;
+    stats->free_blocks = 0;
+    stats->largest_free = 0;
+    for (bp = heap_listp; bp && bp != epilogue; bp = NEXT_BLKP(bp)){
+        if (GET_ALLOC(HDRP(bp)))
+            continue;
+        size = GET_SIZE(HDRP(bp));
+        stats->free_bytes += size;
+        stats->free_blocks++;
+        if (size > stats->largest_free)
+            stats->largest_free = size;
+    }
+}
+
+/*
+ * The heap invariants. mm_validate checks any subset of them (a mask of
+ * MM_CHECK_* bits) in one walk over the heap and one over the free lists,
+ * and describes the first problem it finds in *err.
+ *
+ * The walks always stay inside the heap, whatever the mask: a pointer
+ * leading out of it is reported as MM_CHECK_BOUNDARY and ends the check.
+ */
+
+/* record the first problem found and fail */
+static int check_fail(mm_check_error_t *err, unsigned check, void *bp, const char *msg){
+    if (err){
+        err->check = check;
+        err->bp = bp;
+        err->msg = msg;
+    }
+    return -1;
+}
+
+/* is bp a plausible payload pointer of a block in the heap? */
+#define IN_HEAP(bp)         ((char *)(bp) >= heap_listp && (char *)(bp) <= epilogue \
+                             && !((size_t)(bp) & (ALIGNMENT-1)))
+
+/* the size range of the id-th list of a set */
+#define BIN_LO(id)          ((id) > 0 ? (size_t)(RANGE << ((id) - 1)) : 0)
+#define BIN_HI(id)          ((id) < RANGE_SIZE - 1 ? (size_t)(RANGE << (id)) : (size_t)-1)
+
+/*
+ * mm_validate - Check the invariants selected by mask.
+ *      Returns 0 if they hold, else -1 with the first problem in *err.
+ */
+int mm_validate(unsigned mask, mm_check_error_t *err){
+    size_t heap_free = 0, list_free = 0, size, limit;
+    char *bp, *next, *prev;
+    int free_before = 0;
+
+    if (err){
+        err->check = 0;
+        err->bp = NULL;
+        err->msg = NULL;
+    }
+
+    /* one walk over the heap, from the prologue to the epilogue */
+    for (bp = heap_listp; bp != epilogue; bp = next){
+        size = GET_SIZE(HDRP(bp));
+        next = bp + size;
+        if (size < INITSIZE || (size & (ALIGNMENT-1)) || next > epilogue)
+            return check_fail(err, MM_CHECK_BOUNDARY, bp, "block runs out of the heap");
+
+        if ((mask & MM_CHECK_HEADERS) && !GET_L_ALLOC(HDRP(next)) != !GET_ALLOC(HDRP(bp)))
+            return check_fail(err, MM_CHECK_HEADERS, next, "l_alloc does not match the block before");
+        /* only free blocks (and the prologue) keep their footer: the
+           footer of an allocated block lies in its payload */
+        if ((mask & MM_CHECK_HEADERS) && (!GET_ALLOC(HDRP(bp)) || bp == heap_listp)
+            && (GET_SIZE(FTRP(bp)) != size || GET_ALLOC(FTRP(bp)) != GET_ALLOC(HDRP(bp))))
+            return check_fail(err, MM_CHECK_HEADERS, bp, "header and footer do not match");
+        if (GET_ALLOC(HDRP(bp))){
+            free_before = 0;
+            continue;
+        }
+
+        heap_free++;
+        if ((mask & MM_CHECK_COALESCED) && free_before
+            && CLASS_OF(PREV_BLKP(bp)) == CLASS_OF(bp))
+            return check_fail(err, MM_CHECK_COALESCED, bp, "two adjacent free blocks");
+        free_before = 1;
+    }
+
+    /* one walk over the free lists; no list can be longer than this */
+    limit = (epilogue - heap_listp) / INITSIZE + 1;
+    for (size_t bin = 0; bin < NBINS; bin++){
+        size_t id = bin % RANGE_SIZE;
+        size_t steps = 0;
+        prev = NULL;
+        for (bp = HEAD(bin); bp; prev = bp, bp = SUCC_PTR(bp)){
+            if (!IN_HEAP(bp) || bp == heap_listp || bp == epilogue || ++steps > limit)
+                return check_fail(err, MM_CHECK_BOUNDARY, bp, "free list leaves the heap");
+            list_free++;
+
+            if ((mask & MM_CHECK_LINKS) && PRED_PTR(bp) != prev)
+                return check_fail(err, MM_CHECK_LINKS, bp, "pred and succ do not match");
+            if ((mask & MM_CHECK_FREE_COUNT) && GET_ALLOC(HDRP(bp)))
+                return check_fail(err, MM_CHECK_FREE_COUNT, bp, "allocated block in a free list");
+            size = GET_SIZE(HDRP(bp));
+            if ((mask & MM_CHECK_BINS) && (size <= BIN_LO(id) || size > BIN_HI(id)))
+                return check_fail(err, MM_CHECK_BINS, bp, "block in the wrong size list");
+        }
+    }
+
+    if ((mask & MM_CHECK_FREE_COUNT) && heap_free != list_free)
+        return check_fail(err, MM_CHECK_FREE_COUNT, NULL,
+                          "free lists and heap disagree on the number of free blocks");
+
+    /* the whole heap holds up, so the blocks touched so far need no
+       incremental check; they may not even be blocks any more */
+    if (mask == MM_CHECK_ALL)
+        ntouched = 0;
+    return 0;
+}
+
+/* check one block against its neighbours and its free list: the same
+   invariants as mm_validate, restricted to this block */
+static int check_block(char *bp, mm_check_error_t *err){
+    size_t size, id;
+    char *next, *pred, *succ;
+
+    if (!IN_HEAP(bp))
+        return check_fail(err, MM_CHECK_BOUNDARY, bp, "block outside the heap");
+    if (bp == epilogue || bp == heap_listp) return 0;
+
+    size = GET_SIZE(HDRP(bp));
+    next = bp + size;
+    if (size < INITSIZE || (size & (ALIGNMENT-1)) || next > epilogue)
+        return check_fail(err, MM_CHECK_BOUNDARY, bp, "block runs out of the heap");
+    if (!GET_L_ALLOC(HDRP(next)) != !GET_ALLOC(HDRP(bp)))
+        return check_fail(err, MM_CHECK_HEADERS, next, "l_alloc does not match the block before");
+    if (GET_ALLOC(HDRP(bp))) return 0;
+
+    if (GET_SIZE(FTRP(bp)) != size || GET_ALLOC(FTRP(bp)))
+        return check_fail(err, MM_CHECK_HEADERS, bp, "header and footer do not match");
+    if (!GET_ALLOC(HDRP(next)) && CLASS_OF(next) == CLASS_OF(bp))
+        return check_fail(err, MM_CHECK_COALESCED, bp, "two adjacent free blocks");
+    pred = PRED_PTR(bp);
+    succ = SUCC_PTR(bp);
+    if ((pred && (!IN_HEAP(pred) || SUCC_PTR(pred) != bp))
+        || (succ && (!IN_HEAP(succ) || PRED_PTR(succ) != bp)))
+        return check_fail(err, MM_CHECK_LINKS, bp, "pred and succ do not match");
+    if (!pred){
+        for (id = get_range(size); id < NBINS && HEAD(id) != bp; id += RANGE_SIZE)
+            ;
+        if (id >= NBINS)
+            return check_fail(err, MM_CHECK_FREE_COUNT, bp, "free block not in its free list");
+    }
+    return 0;
+}
+
+/*
+ * mm_checkheap_incremental - Check only the blocks touched since the last
+ *      call, together with the blocks on either side of them. This is
+ *      O(1) per operation; list neighbours far away in the heap are left
+ *      to mm_validate. Returns 0 if all is well, else -1 with *err set.
+ */
+int mm_checkheap_incremental(mm_check_error_t *err){
+    unsigned i, n = ntouched;
+    char *bp;
+
+    ntouched = 0;
+    if (n > TOUCH_RING)
+        return mm_validate(MM_CHECK_ALL, err);
+    for (i = 0; i < n; i++){
+        bp = touched[i];
+        if (check_block(bp, err) < 0) return -1;
+        if (bp > heap_listp && bp < epilogue){
+            if (!GET_L_ALLOC(HDRP(bp)) && check_block(PREV_BLKP(bp), err) < 0)
+                return -1;
+            if (check_block(NEXT_BLKP(bp), err) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * mm_checkheap - verbose 0 and 1 print the prologue/epilogue and the
+ *      block list; 2 to 8 run one check each, numbered as before, and a
+ *      failed check prints what it found and exits.
  */
 void mm_checkheap(int verbose){
+    static const struct {
+        unsigned mask;
+        const char *what;
+    } checks[] = {
+        { MM_CHECK_BOUNDARY, "boundry of heap" },
+        { MM_CHECK_HEADERS, "the header and footer for each block" },
+        { MM_CHECK_COALESCED, "that there are no two consecutive free blocks in the heap" },
+        { MM_CHECK_LINKS, "that all succ and pred pointers are consistent" },
+        { MM_CHECK_BOUNDARY, "if ptr in free list are in boundry" },
+        { MM_CHECK_FREE_COUNT, "that the free list matches the free block in the heap" },
+        { MM_CHECK_BINS, "that all blocks in each free list fall within the list size range" },
+    };
+    mm_check_error_t err;
+
     /* check the epilogue and prologue blocks
        prologue has information of header, footer, alloc and size
        epilogue has information of header, alloc and size */
@@ -389,140 +1033,12 @@ void mm_checkheap(int verbose){
         }
         printf("finish check heap list\n");
     }
-    /* check boundry of heap */
-    else if(verbose == 2){
-        printf("begin check boundry of heap\n");
-        char* bp = heap_listp;
-        size_t size = GET_SIZE(HDRP(bp));
-        while(size > 0){
-            if((size_t)bp < (size_t)mem_heap_lo() || (size_t)bp > (size_t)mem_heap_hi()){
-                printf("illegal ptr: %lu\n", (size_t)(bp));
-                exit(0);
-            }
-            bp = NEXT_BLKP(bp);
-            size = GET_SIZE(HDRP(bp));
-        }
-        printf("finish check boundry of heap\n");
-    }
-    /* check the header and footer for each block */
-    else if(verbose == 3){
-        printf("begin check the header and footer for each block\n");
-        char* bp = heap_listp;
-        size_t size_h = GET_SIZE(HDRP(bp));
-        size_t size_f = GET_SIZE(FTRP(bp));
-        unsigned alloc_h = GET_ALLOC(HDRP(bp));
-        unsigned alloc_f = GET_ALLOC(FTRP(bp));
-        while(size_h > 0){
-            /* check that the header and footer are the same size */
-            if(size_h != size_f){
-                printf("size unmatch: %lu\n", (size_t)(bp));
-                exit(0);
-            }
-            /* check that the header and footer are the same alloc */
-            if(alloc_f != alloc_h){
-                printf("alloc unmatch: %lu\n", (size_t)(bp));
-                exit(0);
-            }
-            bp = NEXT_BLKP(bp);
-            size_h = GET_SIZE(HDRP(bp));
-            size_f = GET_SIZE(FTRP(bp));
-            alloc_h = GET_ALLOC(HDRP(bp));
-            alloc_f = GET_ALLOC(FTRP(bp));
-        }
-        printf("finish check the header and footer for each block\n");
-    }
-    /* check that there are no two consecutive free blocks in the heap */
-    else if(verbose == 4){
-        printf("begin check that there are no two consecutive free blocks in the heap\n");
-        char* prev = heap_listp;
-        char* now = NEXT_BLKP(heap_listp);
-        size_t size = GET_SIZE(HDRP(now));
-        while(size > 0){
-            if(!GET_ALLOC(HDRP(prev)) && !GET_ALLOC(HDRP(now))){
-                printf("two adjacent free block: %lu %lu\n", (size_t)(prev), (size_t)(now));
-                exit(0);
-            }
-            prev = NEXT_BLKP(prev);
-            now = NEXT_BLKP(now);
-            size = GET_SIZE(HDRP(now));
-        }
-        printf("finish check that there are no two consecutive free blocks in the heap\n");
-    }
-    /* check that all succ and pred pointers are consistent */
-    else if(verbose == 5){
-        printf("begin check that all succ and pred pointers are consistent\n");
-
-        for (size_t id = 0; id < RANGE_SIZE; id++){
-            char* prev = head_listp[id];
-            if (!prev) continue;
-            char* bp = SUCC_PTR(prev);
-            while(bp){
-                if (PRED_PTR(bp) != prev){
-                    printf("pred succ not match: prev: %lu, succ: %lu\n", (size_t)(prev), (size_t)(bp));
-                    exit(0);
-                }
-                prev = bp;
-                bp = SUCC_PTR(bp);
-            }
-        }
-        printf("finish check that all succ and pred pointers are consistent\n");
-    }
-    /* check if ptr in free list are in boundry */
-    else if(verbose == 6){
-        printf("begin check if ptr in free list are in boundry\n");
-        for(size_t id = 0; id < RANGE_SIZE; id++){
-            char *bp = head_listp[id];
-            while(bp){
-                if((size_t)bp < (size_t)mem_heap_lo() || (size_t)bp > (size_t)mem_heap_hi()){
-                    printf("illegal ptr: %lu\n", (size_t)(bp));
-                    exit(0);
-                }
-                bp = SUCC_PTR(bp);
-            }
-        }
-        printf("finish check if ptr in free list are in boundry\n");
-    }
-    /* check that the free list matches the free block in the heap */
-    else if (verbose == 7){
-        printf("begin check that the free list matches the free block in the heap\n");
-        int free_cnt = 0;
-        for (size_t id = 0; id < RANGE_SIZE; id++){
-            char *bp = head_listp[id];
-            while(bp){
-                free_cnt++;
-                if (GET_ALLOC(HDRP(bp))){
-                    printf("block: %lu are allocated, but is in the free list\n", (size_t)(bp));
-                    exit(0);
-                }
-                bp = SUCC_PTR(bp);
-            }
-        }
-        char *bp = heap_listp;
-        while(GET_SIZE(HDRP(bp))){
-            if (!GET_ALLOC(HDRP(bp))) free_cnt--;
-            bp = NEXT_BLKP(bp);
-        }
-        if (free_cnt){
-            printf("the total size of the free list is different from the number of free blocks in the heap\n");
+    else if(verbose >= 2 && verbose <= 8){
+        printf("begin check %s\n", checks[verbose - 2].what);
+        if (mm_validate(checks[verbose - 2].mask, &err) < 0){
+            printf("%s: %lu\n", err.msg, (size_t)err.bp);
             exit(0);
         }
-        printf("finish check that the free list matches the free block in the heap\n");
-    }
-    /* check that all blocks in each free list fall within the list size range */
-    else if(verbose == 8){
-        printf("begin check that all blocks in each free list fall within the list size range\n");
-        for(size_t id = 0; id < RANGE_SIZE; id++){
-            char *bp = head_listp[id];
-            while(bp != 0){
-                size_t size = GET_SIZE(HDRP(bp));
-                if((id < RANGE_SIZE - 1 && size > (size_t)(RANGE << id))
-                    || (id > 0 && size <= (size_t)(RANGE << (id - 1)))){
-                    printf("size unmatch: ptr: %lu, size: %lu, id: %lu\n", (size_t)(bp), size, id);
-                    exit(0);
-                }
-                bp = SUCC_PTR(bp);
-            }
-        }
-        printf("finish check that all blocks in each free list fall within the list size range\n");
+        printf("finish check %s\n", checks[verbose - 2].what);
     }
-}
\ No newline at end of file
+}
@@ -20,6 +20,86 @@ extern void *calloc (size_t nmemb, size_t size);
 
 extern int mm_init(void);
 
+/* Lifetime hints: blocks of each class are kept on pages of their own */
+#define MM_HINT_NONE        0   /* no idea; same as mm_malloc */
+#define MM_HINT_SHORT       1   /* freed soon */
+#define MM_HINT_LONG        2   /* lives for a long time */
+#define MM_HINT_PERMANENT   3   /* never freed */
+#define MM_NHINTS           4
+
+extern void *mm_malloc_hint(size_t size, int hint);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
+
+/* Return-code versions for the driver's expensive debug mode. mm_validate
+   checks the invariants in mask over the whole heap in one pass;
+   mm_checkheap_incremental checks only the blocks touched since the last
+   call. Both return 0 if all is well, else -1 with the first problem in
+   *err (which may be NULL). */
+#define MM_CHECK_BOUNDARY   0x01    /* blocks and list pointers stay in the heap */
+#define MM_CHECK_HEADERS    0x02    /* free footers and l_alloc bits agree */
+#define MM_CHECK_COALESCED  0x04    /* no two adjacent free blocks */
+#define MM_CHECK_LINKS      0x08    /* pred and succ pointers agree */
+#define MM_CHECK_BINS       0x10    /* free blocks are in the right size list */
+#define MM_CHECK_FREE_COUNT 0x20    /* the lists hold exactly the free blocks */
+#define MM_CHECK_ALL        0x3f
+
+typedef struct {
+    unsigned check;     /* the MM_CHECK_* bit that failed */
+    void *bp;           /* the block at fault, or NULL */
+    const char *msg;
+} mm_check_error_t;
+
+extern int mm_validate(unsigned mask, mm_check_error_t *err);
+extern int mm_checkheap_incremental(mm_check_error_t *err);
+
+/* The free space in the heap right now, from one walk over it */
+typedef struct {
+    size_t free_bytes;      /* bytes in free blocks, headers included */
+    size_t free_blocks;     /* how many free blocks there are */
+    size_t largest_free;    /* bytes in the largest of them */
+} mm_heap_stats_t;
+
+extern void mm_heap_stats(mm_heap_stats_t *stats);
+
+/* Persistent heaps: resume a heap set up by an earlier mm_init (see
+   mem_init_file), flush it, and keep one user pointer in it. */
+extern int mm_open(int validate);
+extern int mm_checkpoint(void);
+extern void mm_set_root(void *ptr);
+extern void *mm_get_root(void);
+
+/* Regions: bump allocation out of heap chunks, all released at once.
+   A mark taken with mm_region_mark can be rewound to, releasing
+   everything allocated after it. */
+typedef struct mm_region mm_region_t;
+typedef struct {
+    void *chunk;
+    char *cur;
+} mm_region_mark_t;
+
+extern mm_region_t *mm_region_create(void);
+extern void *mm_region_alloc(mm_region_t *r, size_t size);
+extern mm_region_mark_t mm_region_mark(mm_region_t *r);
+extern void mm_region_rewind(mm_region_t *r, mm_region_mark_t m);
+extern void mm_region_destroy(mm_region_t *r);
+
+/* Pools: fixed-size objects with no per-object header, carved out of
+   runs taken from the heap. Empty runs go back to the heap. */
+typedef struct mm_pool mm_pool_t;
+typedef struct {
+    size_t objsize;     /* object size after rounding */
+    size_t runs;        /* runs currently held */
+    size_t bytes;       /* heap bytes held by those runs */
+    size_t live;        /* objects currently allocated */
+    size_t allocs;      /* mm_pool_alloc calls so far */
+    size_t frees;       /* mm_pool_free calls so far */
+} mm_pool_stats_t;
+
+extern mm_pool_t *mm_pool_create(size_t objsize, size_t align);
+extern void *mm_pool_alloc(mm_pool_t *pool);
+extern void mm_pool_free(mm_pool_t *pool, void *obj);
+extern void mm_pool_stats(mm_pool_t *pool, mm_pool_stats_t *stats);
+extern void mm_pool_destroy(mm_pool_t *pool);
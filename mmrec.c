@@ -0,0 +1,611 @@
+/*
+ * mmrec.c - Record the allocator requests of any program as a trace
+ *
+ * Build mmrec.so and run a program with it preloaded:
+ *
+ *     MMREC_OUT=prog.rep LD_PRELOAD=./mmrec.so prog args...
+ *
+ * malloc, calloc, realloc, free, memalign, posix_memalign and
+ * aligned_alloc are passed on to glibc (through its __libc_* entry
+ * points, so there is no dlsym to bootstrap) and recorded on the way.
+ * Each block gets a fresh id; when the program exits the requests are
+ * written out as a text trace that mdriver reads with -f, or as a
+ * binary one if MMREC_OUT ends in .repb. MMREC_OUT defaults to
+ * mmrec.<pid>.rep. A program that ends in _exit leaves no trace.
+ *
+ * The programs a traced program runs inherit LD_PRELOAD and MMREC_OUT,
+ * and are recorded too, each into a file of its own: only the process
+ * that was started with MMREC_OUT set writes MMREC_OUT (it leaves its
+ * pid in MMREC_OWNER for the others to see); the others put their pid
+ * in front of the extension, as in prog.<pid>.rep.
+ *
+ * Recording costs one atomic add for a sequence number, one lookup in
+ * an address map (striped by address, so threads rarely meet on a
+ * lock) and a store into a buffer of the calling thread's own. Full
+ * buffers go onto a lock-free list that a writer thread spools to
+ * <MMREC_OUT>.<pid>.raw (unlinked as soon as it is open) in the
+ * background; at exit the spool is sorted by sequence number into the
+ * trace. The sequence number of a request is
+ * taken where it orders it correctly against the other threads: after
+ * the block is allocated, but before it is freed, so that no other
+ * thread can get the same address back first.
+ *
+ * Alignment is not kept (an aligned request is an alloc of its size),
+ * malloc(0) becomes a 1-byte alloc since the mm package returns NULL
+ * for 0, realloc(p, 0) is a free, and threads past MAX_THREADS share
+ * the thread numbers of the -T replay. A forked child does not record.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "repb.h"
+
+/* glibc's own allocator */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_memalign(size_t align, size_t size);
+
+/* Requests per thread buffer */
+#define CHUNK_OPS       4096
+
+/* The address map: this many stripes, each its own hash table */
+#define NSTRIPES        256
+#define STRIPE_MIN      1024
+
+/* The writer wakes up this often */
+#define WRITER_USECS    10000
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+/* A request as recorded, with its place in the whole program's order */
+typedef struct {
+    unsigned long long seq;
+    traceop_t op;
+} rec_t;
+
+/* A buffer of one thread's requests */
+typedef struct chunk {
+    struct chunk *next;         /* on the full list */
+    int n;
+    rec_t recs[CHUNK_OPS];
+} chunk_t;
+
+/* A recording thread */
+typedef struct thread_rec {
+    struct thread_rec *next;    /* on the list of all of them */
+    chunk_t *chunk;             /* where its requests go */
+    int thread;                 /* its number in the trace */
+} thread_rec_t;
+
+/* One stripe of the address map: open addressing, linear probing */
+typedef struct {
+    volatile int lock;
+    size_t size;                /* slots, a power of two */
+    size_t used;
+    uintptr_t *addr;            /* 0 for an empty slot */
+    int *id;
+} stripe_t;
+
+static volatile int recording = 0;
+static unsigned long long next_seq = 0;
+static int next_id = 0;
+static int next_thread = 0;
+static chunk_t *full = NULL;            /* chunks for the writer */
+static thread_rec_t *threads = NULL;    /* every recording thread */
+static stripe_t stripes[NSTRIPES];
+
+static char out_path[4096];
+static char raw_path[4096 + 32];
+static int raw_fd = -1;
+static pthread_t writer;
+static volatile int writer_stop = 0;
+
+static TLS thread_rec_t *self = NULL;
+static TLS int busy = 0;        /* in the recorder: don't record */
+
+/*
+ * Memory for the recorder itself comes straight from mmap, so that it
+ * never calls the allocator it is recording
+ */
+static void *get_mem(size_t bytes)
+{
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void put_mem(void *p, size_t bytes)
+{
+    if (p)
+	munmap(p, bytes);
+}
+
+/*
+ * The address map
+ */
+static size_t addr_hash(uintptr_t a)
+{
+    return (size_t)((a >> 4) * 0x9e3779b97f4a7c15ULL >> 16);
+}
+
+static stripe_t *stripe_of(uintptr_t a)
+{
+    return &stripes[addr_hash(a) % NSTRIPES];
+}
+
+static void stripe_lock(stripe_t *s)
+{
+    while (__atomic_exchange_n(&s->lock, 1, __ATOMIC_ACQUIRE))
+	while (s->lock)
+	    ;
+}
+
+static void stripe_unlock(stripe_t *s)
+{
+    __atomic_store_n(&s->lock, 0, __ATOMIC_RELEASE);
+}
+
+/* double the stripe (or make its first table) */
+static int stripe_grow(stripe_t *s)
+{
+    size_t i, j, size = s->size ? 2 * s->size : STRIPE_MIN;
+    uintptr_t *addr = get_mem(size * sizeof(*addr));
+    int *id = get_mem(size * sizeof(*id));
+
+    if (!addr || !id) {
+	put_mem(addr, size * sizeof(*addr));
+	put_mem(id, size * sizeof(*id));
+	return -1;
+    }
+    for (i = 0; i < s->size; i++) {
+	if (!s->addr[i])
+	    continue;
+	for (j = addr_hash(s->addr[i]) / NSTRIPES & (size - 1); addr[j];
+	     j = (j + 1) & (size - 1))
+	    ;
+	addr[j] = s->addr[i];
+	id[j] = s->id[i];
+    }
+    put_mem(s->addr, s->size * sizeof(*s->addr));
+    put_mem(s->id, s->size * sizeof(*s->id));
+    s->addr = addr;
+    s->id = id;
+    s->size = size;
+    return 0;
+}
+
+/* map a to id (stripe locked) */
+static void map_put(stripe_t *s, uintptr_t a, int id)
+{
+    size_t j;
+
+    if (2 * (s->used + 1) > s->size && stripe_grow(s) < 0)
+	return;
+    for (j = addr_hash(a) / NSTRIPES & (s->size - 1); s->addr[j];
+	 j = (j + 1) & (s->size - 1))
+	;
+    s->addr[j] = a;
+    s->id[j] = id;
+    s->used++;
+}
+
+/* unmap a and return its id, or -1 if it isn't there (stripe locked);
+   the entries after it move back to keep the probe sequences whole */
+static int map_take(stripe_t *s, uintptr_t a)
+{
+    size_t j, k, home;
+    int id;
+
+    if (!s->size)
+	return -1;
+    for (j = addr_hash(a) / NSTRIPES & (s->size - 1); s->addr[j] != a;
+	 j = (j + 1) & (s->size - 1))
+	if (!s->addr[j])
+	    return -1;
+    id = s->id[j];
+    s->used--;
+    for (k = (j + 1) & (s->size - 1); s->addr[k]; k = (k + 1) & (s->size - 1)) {
+	home = addr_hash(s->addr[k]) / NSTRIPES & (s->size - 1);
+	if (((k - home) & (s->size - 1)) >= ((k - j) & (s->size - 1))) {
+	    s->addr[j] = s->addr[k];
+	    s->id[j] = s->id[k];
+	    j = k;
+	}
+    }
+    s->addr[j] = 0;
+    return id;
+}
+
+/*
+ * The thread buffers
+ */
+
+/* hand a chunk to the writer */
+static void push_full(chunk_t *c)
+{
+    c->next = __atomic_load_n(&full, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&full, &c->next, c, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	;
+}
+
+/* this thread's record, made on its first request */
+static thread_rec_t *get_self(void)
+{
+    thread_rec_t *t;
+
+    if (self)
+	return self;
+    if ((t = get_mem(sizeof(*t))) == NULL)
+	return NULL;
+    t->thread = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED)
+	% MAX_THREADS;
+    t->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&threads, &t->next, t, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	;
+    return self = t;
+}
+
+/* record a request that has sequence number seq */
+static void put_op(unsigned long long seq, int type, int id, size_t size)
+{
+    thread_rec_t *t = get_self();
+    rec_t *r;
+
+    if (!t)
+	return;
+    if (!t->chunk && (t->chunk = get_mem(sizeof(chunk_t))) == NULL)
+	return;
+    r = &t->chunk->recs[t->chunk->n];
+    r->seq = seq;
+    r->op.type = type;
+    r->op.hint = 0;
+    r->op.thread = t->thread;
+    r->op.index = id;
+    r->op.size = size > 0xffffffffUL ? 0xffffffffU : (unsigned)size;
+    if (++t->chunk->n == CHUNK_OPS) {
+	push_full(t->chunk);
+	t->chunk = NULL;
+    }
+}
+
+static unsigned long long take_seq(void)
+{
+    return __atomic_fetch_add(&next_seq, 1, __ATOMIC_SEQ_CST);
+}
+
+/* a new block p of size bytes */
+static void rec_alloc(void *p, size_t size)
+{
+    stripe_t *s = stripe_of((uintptr_t)p);
+    unsigned long long seq;
+    int id;
+
+    stripe_lock(s);
+    id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    seq = take_seq();
+    map_put(s, (uintptr_t)p, id);
+    stripe_unlock(s);
+    put_op(seq, ALLOC, id, size);
+}
+
+/* block p is about to go; returns its id, or -1 if we never saw it */
+static int rec_free(void *p, int type, size_t size)
+{
+    stripe_t *s = stripe_of((uintptr_t)p);
+    unsigned long long seq = 0;
+    int id;
+
+    stripe_lock(s);
+    if ((id = map_take(s, (uintptr_t)p)) >= 0)
+	seq = take_seq();
+    stripe_unlock(s);
+    if (id >= 0)
+	put_op(seq, type, id, size);
+    return id;
+}
+
+/* block id is at p again (after a realloc) */
+static void rec_move(void *p, int id)
+{
+    stripe_t *s = stripe_of((uintptr_t)p);
+
+    stripe_lock(s);
+    map_put(s, (uintptr_t)p, id);
+    stripe_unlock(s);
+}
+
+/*
+ * The writer
+ */
+static void write_chunks(chunk_t *c)
+{
+    chunk_t *next;
+    size_t len;
+    char *p;
+    ssize_t n;
+
+    for (; c; c = next) {
+	next = c->next;
+	p = (char *)c->recs;
+	len = c->n * sizeof(rec_t);
+	while (len > 0 && (n = write(raw_fd, p, len)) > 0) {
+	    p += n;
+	    len -= n;
+	}
+	put_mem(c, sizeof(chunk_t));
+    }
+}
+
+static void *writer_main(void *arg)
+{
+    struct timespec ts = { 0, WRITER_USECS * 1000L };
+
+    (void)arg;
+    busy = 1;
+    while (!writer_stop) {
+	nanosleep(&ts, NULL);
+	write_chunks(__atomic_exchange_n(&full, NULL, __ATOMIC_ACQUIRE));
+    }
+    return NULL;
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+    unsigned long long x = ((const rec_t *)a)->seq;
+    unsigned long long y = ((const rec_t *)b)->seq;
+    return (x > y) - (x < y);
+}
+
+/*
+ * write_trace - sort the spool and write it out as the trace
+ */
+static void write_trace(void)
+{
+    rec_t *recs = NULL;
+    struct stat st;
+    repb_header_t hdr;
+    size_t len = 0, i, n = 0;
+    const char *ext;
+    FILE *f;
+
+    if (fstat(raw_fd, &st) == 0 && (len = st.st_size) >= sizeof(rec_t)) {
+	recs = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, raw_fd, 0);
+	if (recs == MAP_FAILED)
+	    recs = NULL;
+	else
+	    n = len / sizeof(rec_t);
+    }
+    close(raw_fd);
+    if (!n || !recs) {
+	fprintf(stderr, "mmrec: no requests recorded\n");
+	return;
+    }
+    qsort(recs, n, sizeof(rec_t), cmp_seq);
+
+    if ((f = fopen(out_path, "w")) == NULL) {
+	fprintf(stderr, "mmrec: could not open %s: %s\n", out_path,
+		strerror(errno));
+	munmap(recs, len);
+	return;
+    }
+    ext = strrchr(out_path, '.');
+    if (ext && !strcmp(ext, ".repb")) {
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, REPB_MAGIC, sizeof(hdr.magic));
+	hdr.version = REPB_VERSION;
+	hdr.weight = 1;
+	hdr.num_ids = next_id;
+	hdr.num_ops = n;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	for (i = 0; i < n; i++)
+	    fwrite(&recs[i].op, sizeof(traceop_t), 1, f);
+    } else {
+	fprintf(f, "1\n%d\n%zu\n0\n", next_id, n);
+	for (i = 0; i < n; i++) {
+	    traceop_t *op = &recs[i].op;
+	    if (op->type == FREE)
+		fprintf(f, "f %d", op->index);
+	    else
+		fprintf(f, "%c %d %u", op->type == ALLOC ? 'a' : 'r',
+			op->index, op->size);
+	    if (op->thread)
+		fprintf(f, " @%d", op->thread);
+	    fputc('\n', f);
+	}
+    }
+    fclose(f);
+    munmap(recs, len);
+    fprintf(stderr, "mmrec: %zu requests on %d blocks from %d threads in %s\n",
+	    n, next_id, next_thread, out_path);
+}
+
+/*
+ * Start and stop
+ */
+static void no_recording(void)
+{
+    recording = 0;
+}
+
+__attribute__((constructor))
+static void mmrec_start(void)
+{
+    const char *out = getenv("MMREC_OUT");
+    const char *owner = getenv("MMREC_OWNER");
+    const char *ext;
+    char pid[16];
+    int base;
+
+    busy = 1;
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    if (!out) {
+	snprintf(out_path, sizeof(out_path), "mmrec.%s.rep", pid);
+    } else if (!owner || !strcmp(owner, pid)) {
+	/* the process the user started: MMREC_OUT is ours */
+	snprintf(out_path, sizeof(out_path), "%s", out);
+	setenv("MMREC_OWNER", pid, 1);
+    } else {
+	/* one it ran: out.rep becomes out.<pid>.rep */
+	ext = strrchr(out, '.');
+	if (!ext || strchr(ext, '/'))
+	    ext = out + strlen(out);
+	base = (int)(ext - out);
+	snprintf(out_path, sizeof(out_path), "%.*s.%s%s", base, out, pid, ext);
+    }
+
+    /* the spool is this process's alone. One already there with our pid
+       was left by the program we were exec'd from, or by a dead process
+       whose pid we got: no one else can be writing it. */
+    snprintf(raw_path, sizeof(raw_path), "%s.%s.raw", out ? out : "mmrec", pid);
+    raw_fd = open(raw_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (raw_fd < 0 && errno == EEXIST && unlink(raw_path) == 0)
+	raw_fd = open(raw_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (raw_fd < 0) {
+	fprintf(stderr, "mmrec: could not open %s: %s\n", raw_path,
+		strerror(errno));
+	busy = 0;
+	return;
+    }
+    /* it is only reached through raw_fd from now on, so a process that
+       ends in _exit leaves nothing behind */
+    unlink(raw_path);
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+	close(raw_fd);
+	busy = 0;
+	return;
+    }
+    pthread_atfork(NULL, NULL, no_recording);
+    recording = 1;
+    busy = 0;
+}
+
+__attribute__((destructor))
+static void mmrec_stop(void)
+{
+    thread_rec_t *t;
+
+    if (!recording)
+	return;
+    busy = 1;
+    recording = 0;
+    writer_stop = 1;
+    pthread_join(writer, NULL);
+
+    /* what is left: the full chunks since the writer's last look, and
+       the chunk each thread is filling */
+    write_chunks(__atomic_exchange_n(&full, NULL, __ATOMIC_ACQUIRE));
+    for (t = threads; t; t = t->next)
+	if (t->chunk) {
+	    t->chunk->next = NULL;
+	    write_chunks(t->chunk);
+	    t->chunk = NULL;
+	}
+    write_trace();
+    busy = 0;
+}
+
+/*
+ * The interposed functions
+ */
+void *malloc(size_t size)
+{
+    void *p = __libc_malloc(size);
+
+    if (p && recording && !busy) {
+	busy = 1;
+	rec_alloc(p, size ? size : 1);
+	busy = 0;
+    }
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p = __libc_calloc(nmemb, size);
+
+    if (p && recording && !busy) {
+	busy = 1;
+	rec_alloc(p, nmemb * size != 0 ? nmemb * size : 1);
+	busy = 0;
+    }
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr && recording && !busy) {
+	busy = 1;
+	rec_free(ptr, FREE, 0);
+	busy = 0;
+    }
+    __libc_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+    int id;
+
+    if (!ptr)
+	return malloc(size);
+    if (!recording || busy)
+	return __libc_realloc(ptr, size);
+
+    busy = 1;
+    if (size == 0) {
+	rec_free(ptr, FREE, 0);
+	busy = 0;
+	return __libc_realloc(ptr, size);
+    }
+    id = rec_free(ptr, REALLOC, size);
+    p = __libc_realloc(ptr, size);
+    if (id >= 0)
+	rec_move(p ? p : ptr, id);  /* on failure ptr is still the block */
+    else if (p)
+	rec_alloc(p, size);         /* a block from before we started */
+    busy = 0;
+    return p;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    void *p = __libc_memalign(align, size);
+
+    if (p && recording && !busy) {
+	busy = 1;
+	rec_alloc(p, size ? size : 1);
+	busy = 0;
+    }
+    return p;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *p;
+
+    if (align < sizeof(void *) || (align & (align - 1)))
+	return EINVAL;
+    if ((p = memalign(align, size)) == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
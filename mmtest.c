@@ -0,0 +1,526 @@
+/*
+ * mmtest.c - Checks of the mm package's interfaces that the traces
+ *     never call
+ *
+ *   persist - a file-backed heap is written, checkpointed and reopened
+ *             with and without validation; the root and every payload
+ *             must come back, and a root block with a bad epilogue
+ *             offset must be refused
+ *   region  - objects of many sizes are allocated from a region among
+ *             ordinary blocks, rewound to a mark and destroyed; their
+ *             data must hold until then, and afterwards every byte the
+ *             region took must be free again
+ *   pool    - pools of several alignments are filled, half emptied and
+ *             filled again; every object must be aligned, freed objects
+ *             must be reused without new runs, and once the pools are
+ *             gone every byte they took must be free again
+ *   touch   - a short trace replayed as mdriver -D -K 2 does, with full
+ *             and incremental checks by turns, twice on one heap; the
+ *             blocks an earlier request or trace touched must not be
+ *             taken for blocks the incremental check has to look at
+ *
+ * Each check runs on a heap of its own and ends with a full mm_validate.
+ */
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "mmtest.h"
+
+/* persist: blocks in the list kept in the heap, and the most bytes
+   of payload each one carries */
+#define PERSIST_NODES   200
+#define PERSIST_MAXLEN  300
+
+/* region: objects allocated before the mark and after it */
+#define REGION_OBJS     2000
+
+/* pool: objects per pool, the alignments to try, and an object size
+   for each, none of them a multiple of its alignment */
+#define POOL_OBJS       3000
+#define POOL_OBJSIZE(a) (8 * (a) + 20)
+static const size_t pool_aligns[] = { 8, 16, 64, 512, 4096 };
+#define POOL_NALIGNS    (sizeof(pool_aligns) / sizeof(pool_aligns[0]))
+
+/* A block of the persist list. Links are offsets from the bottom of
+   the heap, so they hold wherever the file is mapped next time. */
+typedef struct {
+    size_t next;                /* 0 at the end of the list */
+    int id;
+    int len;
+    unsigned char data[];
+} node_t;
+
+static char why[256];           /* what the last failed check found */
+
+/* note why a check failed, and fail it */
+static int fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(why, sizeof(why), fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+/* the heap must hold up as a whole */
+static int validate(void)
+{
+    mm_check_error_t err;
+
+    if (mm_validate(MM_CHECK_ALL, &err) < 0)
+	return fail("mm_validate: %s (block %p)", err.msg, err.bp);
+    return 0;
+}
+
+/* map an empty heap for a check */
+static int open_heap(void)
+{
+    mem_init();
+    if (mm_init() < 0) {
+	mem_deinit();
+	return fail("mm_init failed");
+    }
+    return 0;
+}
+
+/* the byte at offset j of a payload with this id */
+static unsigned char pattern(int id, int j)
+{
+    return (unsigned char)(id * 31 + j * 7 + 1);
+}
+
+/* the root must lead to every node, with its payload intact */
+static int check_nodes(const char *when)
+{
+    node_t *n = mm_get_root();
+    char *lo = mem_heap_lo();
+    int id, j;
+
+    for (id = PERSIST_NODES - 1; id >= 0; id--) {
+	if (n == NULL)
+	    return fail("%s: the list ends before node %d", when, id);
+	if (n->id != id || n->len != id % PERSIST_MAXLEN + 1)
+	    return fail("%s: node %d has become node %d of %d bytes",
+			when, id, n->id, n->len);
+	for (j = 0; j < n->len; j++)
+	    if (n->data[j] != pattern(id, j))
+		return fail("%s: byte %d of node %d has changed", when, j, id);
+	n = n->next ? (node_t *)(lo + n->next) : NULL;
+    }
+    if (n != NULL)
+	return fail("%s: the list goes on after the last node", when);
+    return 0;
+}
+
+/* write the word at offset off of the heap file */
+static int poke(const char *path, off_t off, unsigned word)
+{
+    int fd = open(path, O_WRONLY);
+    int ok;
+
+    if (fd < 0)
+	return -1;
+    ok = pwrite(fd, &word, sizeof(word), off) == sizeof(word);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+/*
+ * check_persist - write a heap to a file, reopen it and check it
+ */
+static int check_persist(void)
+{
+    char path[] = "/tmp/mmtestXXXXXX";
+    static const unsigned bad_epi[] = { 3, 0xfffffff0 };
+    char *lo;
+    node_t *n, *head = NULL;
+    void *junk[PERSIST_NODES];
+    int fd, id, j, validated, ret = -1;
+    unsigned i;
+
+    if ((fd = mkstemp(path)) < 0)
+	return fail("cannot make a heap file");
+    close(fd);
+
+    /* build the list, with freed blocks in between, and checkpoint it */
+    if (mem_init_file(path) < 0) {
+	fail("mem_init_file failed");
+	goto out;
+    }
+    if (mm_init() < 0) {
+	fail("mm_init failed");
+	goto unmap;
+    }
+    lo = mem_heap_lo();
+    for (id = 0; id < PERSIST_NODES; id++) {
+	junk[id] = mm_malloc(id % 50 + 8);
+	if ((n = mm_malloc(sizeof(node_t) + id % PERSIST_MAXLEN + 1)) == NULL) {
+	    fail("mm_malloc failed");
+	    goto unmap;
+	}
+	n->next = head ? (size_t)((char *)head - lo) : 0;
+	n->id = id;
+	n->len = id % PERSIST_MAXLEN + 1;
+	for (j = 0; j < n->len; j++)
+	    n->data[j] = pattern(id, j);
+	head = n;
+    }
+    for (id = 0; id < PERSIST_NODES; id += 2)
+	mm_free(junk[id]);
+    mm_set_root(head);
+    if (mm_checkpoint() < 0 || validate() < 0 || check_nodes("written") < 0)
+	goto unmap;
+    mem_deinit();
+
+    /* reopen it both ways; the heap must also take new requests */
+    for (validated = 0; validated <= 1; validated++) {
+	const char *when = validated ? "validated reopen" : "reopen";
+
+	if (mem_init_file(path) < 0) {
+	    fail("mem_init_file failed");
+	    goto out;
+	}
+	if (mm_open(validated) < 0) {
+	    fail("%s: mm_open refused the heap", when);
+	    goto unmap;
+	}
+	if (check_nodes(when) < 0)
+	    goto unmap;
+	for (id = 0; id < PERSIST_NODES; id++)
+	    junk[id] = mm_malloc(id % 70 + 1);
+	for (id = 0; id < PERSIST_NODES; id++)
+	    mm_free(junk[id]);
+	if (validate() < 0 || check_nodes(when) < 0)
+	    goto unmap;
+	mem_deinit();
+    }
+
+    /* a root block whose epilogue offset (its second word) is misaligned
+       or past the end of any heap must be refused */
+    for (i = 0; i < sizeof(bad_epi) / sizeof(bad_epi[0]); i++) {
+	if (poke(path, sizeof(unsigned), bad_epi[i]) < 0) {
+	    fail("cannot write the heap file");
+	    goto out;
+	}
+	if (mem_init_file(path) < 0) {
+	    fail("mem_init_file failed");
+	    goto out;
+	}
+	if (mm_open(0) == 0) {
+	    fail("mm_open took an epilogue offset of %#x", bad_epi[i]);
+	    goto unmap;
+	}
+	mem_deinit();
+    }
+    ret = 0;
+    goto out;
+
+unmap:
+    mem_deinit();
+out:
+    unlink(path);
+    return ret;
+}
+
+/* region objects: sizes, and whether they still hold their data */
+static size_t region_size(int i)
+{
+    return (size_t)(i * 37 % 500 + 1);
+}
+
+static int region_intact(unsigned char **objs, int from, int to)
+{
+    int i;
+    size_t j;
+
+    for (i = from; i < to; i++) {
+	if ((size_t)objs[i] & 7)
+	    return fail("region object %d at %p is not aligned", i, objs[i]);
+	for (j = 0; j < region_size(i); j++)
+	    if (objs[i][j] != pattern(i, j))
+		return fail("byte %zu of region object %d has changed", j, i);
+    }
+    return 0;
+}
+
+/*
+ * check_region - fill a region, rewind it and destroy it
+ */
+static int check_region(void)
+{
+    static unsigned char *objs[2 * REGION_OBJS];
+    void *blocks[REGION_OBJS];
+    mm_region_t *r;
+    mm_region_mark_t mark;
+    mm_heap_stats_t before, after;
+    size_t j, heap_before;
+    int i, ret = -1;
+
+    if (open_heap() < 0)
+	return -1;
+    mm_heap_stats(&before);
+    heap_before = mem_heapsize();
+
+    if ((r = mm_region_create()) == NULL) {
+	fail("mm_region_create failed");
+	goto out;
+    }
+    mark = mm_region_mark(r);
+    for (i = 0; i < 2 * REGION_OBJS; i++) {
+	if (i == REGION_OBJS)
+	    mark = mm_region_mark(r);
+	/* ordinary blocks in between, so the chunks are not all adjacent */
+	if (i < REGION_OBJS && (blocks[i] = mm_malloc(i % 90 + 1)) == NULL) {
+	    fail("mm_malloc failed");
+	    goto out;
+	}
+	if ((objs[i] = mm_region_alloc(r, region_size(i))) == NULL) {
+	    fail("mm_region_alloc failed");
+	    goto out;
+	}
+	for (j = 0; j < region_size(i); j++)
+	    objs[i][j] = pattern(i, j);
+    }
+    if (region_intact(objs, 0, 2 * REGION_OBJS) < 0 || validate() < 0)
+	goto out;
+
+    /* rewinding gives back only what came after the mark */
+    mm_region_rewind(r, mark);
+    if (region_intact(objs, 0, REGION_OBJS) < 0 || validate() < 0)
+	goto out;
+    for (i = REGION_OBJS; i < 2 * REGION_OBJS; i++)
+	if ((objs[i] = mm_region_alloc(r, region_size(i))) == NULL) {
+	    fail("mm_region_alloc failed after a rewind");
+	    goto out;
+	}
+
+    for (i = 0; i < REGION_OBJS; i++)
+	mm_free(blocks[i]);
+    mm_region_destroy(r);
+    if (validate() < 0)
+	goto out;
+
+    /* every byte the heap grew by is free again */
+    mm_heap_stats(&after);
+    if (after.free_bytes - before.free_bytes != mem_heapsize() - heap_before) {
+	fail("%zu bytes are still held after mm_region_destroy",
+	     mem_heapsize() - heap_before - (after.free_bytes - before.free_bytes));
+	goto out;
+    }
+    ret = 0;
+out:
+    mem_deinit();
+    return ret;
+}
+
+/* pool objects: each one is filled with a byte of its own, by index */
+static int pool_intact(unsigned char **objs, size_t objsize, size_t align)
+{
+    int i;
+    size_t j;
+
+    for (i = 0; i < POOL_OBJS; i++) {
+	if ((size_t)objs[i] & (align - 1))
+	    return fail("pool object %d at %p is not aligned to %zu",
+			i, objs[i], align);
+	for (j = 0; j < objsize; j++)
+	    if (objs[i][j] != pattern(i, 0))
+		return fail("pool object %d (align %zu) has changed", i, align);
+    }
+    return 0;
+}
+
+/*
+ * check_pool - fill, half empty and refill pools of several alignments
+ */
+static int check_pool(void)
+{
+    static unsigned char *objs[POOL_NALIGNS][POOL_OBJS];
+    mm_pool_t *pools[POOL_NALIGNS];
+    mm_pool_stats_t st;
+    mm_heap_stats_t before, after;
+    size_t a, runs, heap_before;
+    int i, ret = -1;
+
+    if (open_heap() < 0)
+	return -1;
+    mm_heap_stats(&before);
+    heap_before = mem_heapsize();
+
+    for (a = 0; a < POOL_NALIGNS; a++) {
+	if ((pools[a] = mm_pool_create(POOL_OBJSIZE(a), pool_aligns[a])) == NULL) {
+	    fail("mm_pool_create(%zu, %zu) failed", POOL_OBJSIZE(a),
+		 pool_aligns[a]);
+	    goto out;
+	}
+    }
+
+    /* fill the pools by turns, so their runs are mixed in the heap */
+    for (i = 0; i < POOL_OBJS; i++)
+	for (a = 0; a < POOL_NALIGNS; a++) {
+	    if ((objs[a][i] = mm_pool_alloc(pools[a])) == NULL) {
+		fail("mm_pool_alloc failed (align %zu)", pool_aligns[a]);
+		goto out;
+	    }
+	    memset(objs[a][i], pattern(i, 0), POOL_OBJSIZE(a));
+	}
+    for (a = 0; a < POOL_NALIGNS; a++)
+	if (pool_intact(objs[a], POOL_OBJSIZE(a), pool_aligns[a]) < 0)
+	    goto out;
+    if (validate() < 0)
+	goto out;
+
+    /* free every other object and take as many back: the pool must
+       find room in its own runs */
+    for (a = 0; a < POOL_NALIGNS; a++) {
+	mm_pool_stats(pools[a], &st);
+	runs = st.runs;
+	for (i = 0; i < POOL_OBJS; i += 2)
+	    mm_pool_free(pools[a], objs[a][i]);
+	for (i = 0; i < POOL_OBJS; i += 2) {
+	    if ((objs[a][i] = mm_pool_alloc(pools[a])) == NULL) {
+		fail("mm_pool_alloc failed after frees (align %zu)",
+		     pool_aligns[a]);
+		goto out;
+	    }
+	    memset(objs[a][i], pattern(i, 0), POOL_OBJSIZE(a));
+	}
+	mm_pool_stats(pools[a], &st);
+	if (st.runs != runs || st.live != POOL_OBJS) {
+	    fail("align %zu: %zu runs and %zu live objects after refilling, "
+		 "not %zu and %d", pool_aligns[a], st.runs, st.live,
+		 runs, POOL_OBJS);
+	    goto out;
+	}
+	if (pool_intact(objs[a], POOL_OBJSIZE(a), pool_aligns[a]) < 0)
+	    goto out;
+    }
+    if (validate() < 0)
+	goto out;
+
+    /* empty the pools: all but one run each goes back to the heap */
+    for (a = 0; a < POOL_NALIGNS; a++) {
+	for (i = 0; i < POOL_OBJS; i++)
+	    mm_pool_free(pools[a], objs[a][i]);
+	mm_pool_stats(pools[a], &st);
+	if (st.live != 0 || st.runs > 1) {
+	    fail("align %zu: %zu runs and %zu live objects once emptied",
+		 pool_aligns[a], st.runs, st.live);
+	    goto out;
+	}
+    }
+    if (validate() < 0)
+	goto out;
+    for (a = 0; a < POOL_NALIGNS; a++)
+	mm_pool_destroy(pools[a]);
+    if (validate() < 0)
+	goto out;
+
+    mm_heap_stats(&after);
+    if (after.free_bytes - before.free_bytes != mem_heapsize() - heap_before) {
+	fail("%zu bytes are still held after mm_pool_destroy",
+	     mem_heapsize() - heap_before - (after.free_bytes - before.free_bytes));
+	goto out;
+    }
+    ret = 0;
+out:
+    mem_deinit();
+    return ret;
+}
+
+/* touch: 1/3/6/0; a 0 100; a 1 100; a 2 100; f 1; f 0; f 2 */
+static const struct {
+    char type;                  /* 'a' or 'f', as in a trace file */
+    int index;
+    size_t size;
+} touch_trace[] = {
+    { 'a', 0, 100 }, { 'a', 1, 100 }, { 'a', 2, 100 },
+    { 'f', 1, 0 }, { 'f', 0, 0 }, { 'f', 2, 0 },
+};
+#define TOUCH_OPS       (sizeof(touch_trace) / sizeof(touch_trace[0]))
+
+/*
+ * check_touch - replay touch_trace with a full check every other request
+ *      and an incremental one in between; the second time round, the
+ *      first check after mm_init is an incremental one, with blocks of
+ *      the old heap still in the ring
+ */
+static int check_touch(void)
+{
+    void *blocks[3];
+    mm_check_error_t err;
+    unsigned i, round;
+    int ret = -1;
+
+    if (open_heap() < 0)
+	return -1;
+    for (round = 0; round < 2; round++) {
+	if (round > 0) {
+	    /* leave blocks past the end of a fresh heap in the ring */
+	    for (i = 0; i < 3; i++)
+		mm_malloc(100);
+	    mem_reset_brk();
+	    if (mm_init() < 0) {
+		fail("mm_init failed");
+		goto out;
+	    }
+	}
+	for (i = 0; i < TOUCH_OPS; i++) {
+	    if (((i + round) % 2 == 0 ? mm_validate(MM_CHECK_ALL, &err)
+		 : mm_checkheap_incremental(&err)) < 0) {
+		fail("round %u, request %u: %s (block %p)",
+		     round, i, err.msg, err.bp);
+		goto out;
+	    }
+	    if (touch_trace[i].type == 'a')
+		blocks[touch_trace[i].index] = mm_malloc(touch_trace[i].size);
+	    else
+		mm_free(blocks[touch_trace[i].index]);
+	}
+    }
+    if (mm_checkheap_incremental(&err) < 0) {
+	fail("at the end: %s (block %p)", err.msg, err.bp);
+	goto out;
+    }
+    ret = validate();
+out:
+    mem_deinit();
+    return ret;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(void);
+} checks[] = {
+    { "persist", check_persist },
+    { "region", check_region },
+    { "pool", check_pool },
+    { "touch", check_touch },
+};
+
+/*
+ * mmtest_run - run every check and report on it
+ */
+int mmtest_run(void)
+{
+    unsigned i;
+    int failed = 0;
+
+    printf("\nInterface checks for mm malloc:\n");
+    for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+	if (checks[i].run() == 0) {
+	    printf("%-12sok\n", checks[i].name);
+	} else {
+	    printf("%-12sFAILED: %s\n", checks[i].name, why);
+	    failed++;
+	}
+    }
+    return failed;
+}
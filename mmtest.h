@@ -0,0 +1,8 @@
+/*
+ * mmtest.h - prototypes for the checks in mmtest.c of the mm package's
+ *     interfaces that no trace exercises
+ */
+
+/* Run every check on a heap of its own, print how each one went, and
+   return the number that failed */
+int mmtest_run(void);
@@ -0,0 +1,400 @@
+/*
+ * mtbench.c - Synthetic multi-threaded allocator benchmarks
+ *
+ * Three workloads after the classic allocator stress tests:
+ *   larson     - each thread replaces random blocks in an array of live
+ *                blocks; between rounds the arrays move to other threads,
+ *                which then free blocks they did not allocate
+ *   threadtest - each thread allocates a batch of blocks and frees them
+ *                again, sharing nothing
+ *   xmalloc    - each thread allocates blocks for the next thread in a
+ *                ring and frees the blocks the previous one sent it
+ *
+ * Each runs at 1 to max_threads threads, doing the same work per thread,
+ * on libc malloc or the mm package. The mm package keeps its state in
+ * globals, so its calls are serialized by a lock unless the driver is
+ * built with -DMM_THREAD_SAFE for a package that locks for itself.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "mtbench.h"
+
+/* larson: live blocks per thread, rounds, replacements per round */
+#define LARSON_SLOTS    1000
+#define LARSON_ROUNDS   10
+#define LARSON_ITERS    10000
+#define LARSON_MIN      16
+#define LARSON_MAX      512
+
+/* threadtest: rounds, blocks per round, block size */
+#define THREADTEST_ROUNDS 100
+#define THREADTEST_OBJS   1000
+#define THREADTEST_SIZE   64
+
+/* xmalloc: blocks each thread sends, and how many at a time */
+#define XMALLOC_BLOCKS  100000
+#define XMALLOC_BATCH   100
+#define XMALLOC_MIN     16
+#define XMALLOC_MAX     256
+
+/* How often the libc heap size is sampled while a benchmark runs */
+#define SAMPLE_USECS    100
+
+static const char *names[MB_NBENCH] = {
+    "larson",
+    "threadtest",
+    "xmalloc",
+};
+
+/* The blocks sent to one xmalloc thread */
+typedef struct {
+    pthread_mutex_t lock;
+    void **blocks;              /* ring of XMALLOC_BLOCKS */
+    int head, count;
+} queue_t;
+
+/* One run of a benchmark */
+typedef struct {
+    int bench;
+    int use_libc;
+    int nthreads;
+    pthread_barrier_t start;    /* the threads and the main thread */
+    pthread_barrier_t round;    /* larson: the threads between rounds */
+    int finished;               /* threads done so far */
+    void ***arrays;             /* larson: the arrays of live blocks */
+    queue_t *queues;            /* xmalloc: one per thread */
+} run_t;
+
+typedef struct {
+    run_t *run;
+    int id;
+    unsigned seed;
+    long ops;                   /* mallocs and frees made */
+    double end;                 /* when the thread finished */
+} worker_t;
+
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the time in seconds on a clock that only goes forward */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * bench_malloc, bench_free - the allocator under test
+ */
+static void *bench_malloc(run_t *run, size_t size)
+{
+    void *p;
+
+    if (run->use_libc)
+	return malloc(size);
+#ifndef MM_THREAD_SAFE
+    pthread_mutex_lock(&mm_lock);
+#endif
+    p = mm_malloc(size);
+#ifndef MM_THREAD_SAFE
+    pthread_mutex_unlock(&mm_lock);
+#endif
+    return p;
+}
+
+static void bench_free(run_t *run, void *p)
+{
+    if (run->use_libc) {
+	free(p);
+	return;
+    }
+#ifndef MM_THREAD_SAFE
+    pthread_mutex_lock(&mm_lock);
+#endif
+    mm_free(p);
+#ifndef MM_THREAD_SAFE
+    pthread_mutex_unlock(&mm_lock);
+#endif
+}
+
+/* a random size in [lo, hi] */
+static size_t rand_size(worker_t *w, size_t lo, size_t hi)
+{
+    return lo + rand_r(&w->seed) % (hi - lo + 1);
+}
+
+static void *must_malloc(worker_t *w, size_t size)
+{
+    void *p;
+
+    if ((p = bench_malloc(w->run, size)) == NULL) {
+	fprintf(stderr, "%s: malloc of %zu bytes failed\n",
+		names[w->run->bench], size);
+	exit(1);
+    }
+    w->ops++;
+    return p;
+}
+
+static void must_free(worker_t *w, void *p)
+{
+    bench_free(w->run, p);
+    w->ops++;
+}
+
+static void larson(worker_t *w)
+{
+    run_t *run = w->run;
+    void **blocks = run->arrays[w->id];
+    int i, k, r;
+
+    for (i = 0; i < LARSON_SLOTS; i++)
+	blocks[i] = must_malloc(w, rand_size(w, LARSON_MIN, LARSON_MAX));
+    for (r = 0; r < LARSON_ROUNDS; r++) {
+	pthread_barrier_wait(&run->round);
+	blocks = run->arrays[(w->id + r) % run->nthreads];
+	for (i = 0; i < LARSON_ITERS; i++) {
+	    k = rand_r(&w->seed) % LARSON_SLOTS;
+	    must_free(w, blocks[k]);
+	    blocks[k] = must_malloc(w, rand_size(w, LARSON_MIN, LARSON_MAX));
+	}
+    }
+    pthread_barrier_wait(&run->round);
+    blocks = run->arrays[w->id];
+    for (i = 0; i < LARSON_SLOTS; i++)
+	must_free(w, blocks[i]);
+}
+
+static void threadtest(worker_t *w)
+{
+    void *blocks[THREADTEST_OBJS];
+    int i, r;
+
+    for (r = 0; r < THREADTEST_ROUNDS; r++) {
+	for (i = 0; i < THREADTEST_OBJS; i++)
+	    blocks[i] = must_malloc(w, THREADTEST_SIZE);
+	for (i = 0; i < THREADTEST_OBJS; i++)
+	    must_free(w, blocks[i]);
+    }
+}
+
+static void xmalloc(worker_t *w)
+{
+    run_t *run = w->run;
+    queue_t *out = &run->queues[(w->id + 1) % run->nthreads];
+    queue_t *in = &run->queues[w->id];
+    void *batch[XMALLOC_BATCH];
+    int produced = 0, consumed = 0;
+    int i, n;
+
+    while (consumed < XMALLOC_BLOCKS) {
+	if (produced < XMALLOC_BLOCKS) {
+	    for (n = 0; n < XMALLOC_BATCH && produced < XMALLOC_BLOCKS; n++, produced++)
+		batch[n] = must_malloc(w, rand_size(w, XMALLOC_MIN, XMALLOC_MAX));
+	    pthread_mutex_lock(&out->lock);
+	    for (i = 0; i < n; i++)
+		out->blocks[(out->head + out->count++) % XMALLOC_BLOCKS] = batch[i];
+	    pthread_mutex_unlock(&out->lock);
+	}
+
+	pthread_mutex_lock(&in->lock);
+	for (n = 0; n < XMALLOC_BATCH && in->count > 0; n++, in->count--) {
+	    batch[n] = in->blocks[in->head];
+	    in->head = (in->head + 1) % XMALLOC_BLOCKS;
+	}
+	pthread_mutex_unlock(&in->lock);
+	for (i = 0; i < n; i++)
+	    must_free(w, batch[i]);
+	consumed += n;
+	if (n == 0)
+	    sched_yield();
+    }
+}
+
+/*
+ * bench_thread - one thread of a benchmark run (the pthread body)
+ */
+static void *bench_thread(void *arg)
+{
+    worker_t *w = arg;
+    run_t *run = w->run;
+
+    pthread_barrier_wait(&run->start);
+    switch (run->bench) {
+    case MB_LARSON:
+	larson(w);
+	break;
+    case MB_THREADTEST:
+	threadtest(w);
+	break;
+    case MB_XMALLOC:
+	xmalloc(w);
+	break;
+    }
+    w->end = now();
+    __sync_fetch_and_add(&run->finished, 1);
+    return NULL;
+}
+
+/*
+ * resident_size - the bytes of the process in memory. mallinfo only
+ *     sees libc's main arena, and threads get arenas of their own, so
+ *     the libc heap is measured by how much the process grows.
+ */
+static size_t resident_size(void)
+{
+    FILE *f;
+    unsigned long pages, resident = 0;
+
+    if ((f = fopen("/proc/self/statm", "r")) != NULL) {
+	if (fscanf(f, "%lu %lu", &pages, &resident) != 2)
+	    resident = 0;
+	fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * run_bench - run one benchmark on nthreads threads; returns the
+ *     seconds it took, and the peak heap size in *peak
+ */
+static double run_bench(int bench, int nthreads, int use_libc,
+			long *ops, size_t *peak)
+{
+    run_t run;
+    worker_t *workers;
+    pthread_t *tids;
+    size_t base = 0, size;
+    double start, end = 0;
+    int i;
+
+    memset(&run, 0, sizeof(run));
+    run.bench = bench;
+    run.use_libc = use_libc;
+    run.nthreads = nthreads;
+    workers = calloc(nthreads, sizeof(*workers));
+    tids = calloc(nthreads, sizeof(*tids));
+    run.arrays = calloc(nthreads, sizeof(*run.arrays));
+    run.queues = calloc(nthreads, sizeof(*run.queues));
+    if (!workers || !tids || !run.arrays || !run.queues) {
+	fprintf(stderr, "run_bench: calloc failed\n");
+	exit(1);
+    }
+    for (i = 0; i < nthreads; i++) {
+	if (bench == MB_LARSON &&
+	    (run.arrays[i] = calloc(LARSON_SLOTS, sizeof(void *))) == NULL) {
+	    fprintf(stderr, "run_bench: calloc failed\n");
+	    exit(1);
+	}
+	if (bench == MB_XMALLOC &&
+	    (run.queues[i].blocks = calloc(XMALLOC_BLOCKS, sizeof(void *))) == NULL) {
+	    fprintf(stderr, "run_bench: calloc failed\n");
+	    exit(1);
+	}
+	/* touch the queue now, so that it is not counted as heap */
+	if (bench == MB_XMALLOC)
+	    memset(run.queues[i].blocks, 0, XMALLOC_BLOCKS * sizeof(void *));
+	pthread_mutex_init(&run.queues[i].lock, NULL);
+    }
+
+    if (use_libc) {
+	base = resident_size();
+    } else {
+	mem_reset_brk();
+	if (mm_init() < 0) {
+	    fprintf(stderr, "run_bench: mm_init failed\n");
+	    exit(1);
+	}
+    }
+
+    /* the main thread joins the start barrier, then watches the heap */
+    pthread_barrier_init(&run.start, NULL, nthreads + 1);
+    pthread_barrier_init(&run.round, NULL, nthreads);
+    for (i = 0; i < nthreads; i++) {
+	workers[i].run = &run;
+	workers[i].id = i;
+	workers[i].seed = i + 1;
+	if (pthread_create(&tids[i], NULL, bench_thread, &workers[i]) != 0) {
+	    fprintf(stderr, "run_bench: pthread_create failed\n");
+	    exit(1);
+	}
+    }
+    pthread_barrier_wait(&run.start);
+    start = now();
+
+    *peak = 0;
+    while (use_libc && __sync_fetch_and_add(&run.finished, 0) < nthreads) {
+	if ((size = resident_size()) > base && size - base > *peak)
+	    *peak = size - base;
+	usleep(SAMPLE_USECS);
+    }
+    for (i = 0; i < nthreads; i++) {
+	pthread_join(tids[i], NULL);
+	if (workers[i].end > end)
+	    end = workers[i].end;
+    }
+    if (!use_libc)
+	*peak = mem_heapsize();
+
+    *ops = 0;
+    for (i = 0; i < nthreads; i++) {
+	*ops += workers[i].ops;
+	free(run.arrays[i]);
+	free(run.queues[i].blocks);
+	pthread_mutex_destroy(&run.queues[i].lock);
+    }
+    pthread_barrier_destroy(&run.start);
+    pthread_barrier_destroy(&run.round);
+    free(workers);
+    free(tids);
+    free(run.arrays);
+    free(run.queues);
+    return end - start;
+}
+
+/*
+ * mtbench_lookup - benchmark number of name
+ */
+int mtbench_lookup(const char *name)
+{
+    int i;
+
+    if (strcmp(name, "all") == 0)
+	return MB_NBENCH;
+    for (i = 0; i < MB_NBENCH; i++)
+	if (strcmp(name, names[i]) == 0)
+	    return i;
+    return -1;
+}
+
+/*
+ * mtbench_run - run and report a benchmark, or all of them
+ */
+void mtbench_run(int bench, int max_threads, int use_libc)
+{
+    int b, n;
+    long ops;
+    size_t peak;
+    double secs;
+
+    printf("\nScalability benchmarks for %s:\n", use_libc ? "libc malloc" : "mm malloc");
+    printf("%-12s%8s%12s%12s\n", "benchmark", "threads", "Kops", "peak KB");
+    for (b = 0; b < MB_NBENCH; b++) {
+	if (bench != MB_NBENCH && bench != b)
+	    continue;
+	for (n = 1; n <= max_threads; n++) {
+	    secs = run_bench(b, n, use_libc, &ops, &peak);
+	    printf("%-12s%8d%12.0f%12zu\n", names[b], n,
+		   secs > 0 ? ops / secs / 1e3 : 0.0, peak / 1024);
+	}
+    }
+}
@@ -0,0 +1,20 @@
+/*
+ * mtbench.h - prototypes for the synthetic multi-threaded benchmarks
+ *     in mtbench.c (after larson, threadtest and xmalloc-test)
+ */
+
+/* The benchmarks */
+enum {
+    MB_LARSON,          /* server threads that pass their blocks on */
+    MB_THREADTEST,      /* private malloc/free loops */
+    MB_XMALLOC,         /* producers and consumers in a ring */
+    MB_NBENCH
+};
+
+/* Benchmark number for name, MB_NBENCH for "all", or -1 if unknown */
+int mtbench_lookup(const char *name);
+
+/* Run benchmark bench (or all of them, for MB_NBENCH) on 1 to
+   max_threads threads, on libc malloc or the mm package, and print
+   the throughput and peak heap size at each thread count */
+void mtbench_run(int bench, int max_threads, int use_libc);
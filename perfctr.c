@@ -0,0 +1,215 @@
+/*
+ * perfctr.c - Count memory-system events around a piece of code
+ *
+ * Uses perf_event_open(2) where the kernel lets us. Page faults fall back
+ * to getrusage(2), which is always there; events that can be counted
+ * neither way are simply reported as invalid. When there are more events
+ * than hardware counters the kernel takes turns with them, and we scale
+ * each count up by the share of the time it was actually counted. The
+ * kernel's times run on from the first window, so that share is taken
+ * between the readings at perfctr_start and perfctr_stop. (One group of
+ * all the hardware events would not need scaling, but a group that does
+ * not fit in the counters is never counted at all.)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "perfctr.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+static int fds[PC_NEVENTS];
+static long long start_vals[PC_NEVENTS];
+#ifdef __linux__
+static unsigned long long start_reads[PC_NEVENTS][3];
+#endif
+static int initialized = 0;
+
+static const char *names[PC_NEVENTS] = {
+    "faults",
+    "dTLB",
+    "instr",
+    "brmiss",
+    "L1Dmiss",
+    "LLCmiss",
+};
+
+/* 
+ * faults_rusage - page faults so far according to getrusage
+ */
+static long long faults_rusage(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (long long)ru.ru_minflt + ru.ru_majflt;
+}
+
+#ifdef __linux__
+/* 
+ * open_event - open a single counting event for this process
+ */
+static int open_event(unsigned type, unsigned long long config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+		       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* 
+ * read_event - read an event's count, time enabled and time running
+ */
+static int read_event(int fd, unsigned long long val[3])
+{
+    return read(fd, val, 3 * sizeof(*val)) == 3 * sizeof(*val);
+}
+
+/*
+ * scale_event - the count of an event since the reading v0, scaled up if
+ *     it was multiplexed in between; -1 if it was never counted
+ */
+static double scale_event(const unsigned long long v0[3],
+			  const unsigned long long v1[3])
+{
+    unsigned long long enabled = v1[1] - v0[1], running = v1[2] - v0[2];
+
+    if (running == 0)
+	return -1;
+    if (running < enabled)
+	return (double)(v1[0] - v0[0]) * enabled / running;
+    return v1[0] - v0[0];
+}
+
+/*
+ * cache_event - the config of a read-miss event on a cache
+ */
+static unsigned long long cache_event(unsigned long long cache)
+{
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+#endif
+
+/*
+ * perfctr_init - open the counters
+ */
+int perfctr_init(void)
+{
+    int i, n = 0;
+
+    if (!initialized) {
+	for (i = 0; i < PC_NEVENTS; i++)
+	    fds[i] = -1;
+#ifdef __linux__
+	fds[PC_PAGE_FAULTS] = open_event(PERF_TYPE_SOFTWARE, 
+					 PERF_COUNT_SW_PAGE_FAULTS);
+	fds[PC_DTLB_MISSES] = open_event(PERF_TYPE_HW_CACHE,
+					 cache_event(PERF_COUNT_HW_CACHE_DTLB));
+	fds[PC_INSTRUCTIONS] = open_event(PERF_TYPE_HARDWARE,
+					  PERF_COUNT_HW_INSTRUCTIONS);
+	fds[PC_BRANCH_MISSES] = open_event(PERF_TYPE_HARDWARE,
+					   PERF_COUNT_HW_BRANCH_MISSES);
+	fds[PC_L1D_MISSES] = open_event(PERF_TYPE_HW_CACHE,
+					cache_event(PERF_COUNT_HW_CACHE_L1D));
+	fds[PC_LLC_MISSES] = open_event(PERF_TYPE_HARDWARE,
+					PERF_COUNT_HW_CACHE_MISSES);
+#endif
+	initialized = 1;
+    }
+
+    /* page faults can always be had from getrusage */
+    for (i = 0; i < PC_NEVENTS; i++)
+	n += (fds[i] >= 0 || i == PC_PAGE_FAULTS);
+    return n;
+}
+
+/*
+ * perfctr_close - close the counters; a forked child calls this and
+ *     then perfctr_init, since the counters it inherits count its parent
+ */
+void perfctr_close(void)
+{
+    int i;
+
+    if (!initialized)
+	return;
+    for (i = 0; i < PC_NEVENTS; i++)
+	if (fds[i] >= 0)
+	    close(fds[i]);
+    initialized = 0;
+}
+
+/*
+ * perfctr_start - remember where every counter is now, and the times
+ *     it has been enabled and running
+ */
+void perfctr_start(void)
+{
+    int i;
+
+    for (i = 0; i < PC_NEVENTS; i++) {
+#ifdef __linux__
+	if (fds[i] >= 0) {
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	    if (!read_event(fds[i], start_reads[i]))
+		memset(start_reads[i], 0, sizeof(start_reads[i]));
+	    continue;
+	}
+#endif
+	start_vals[i] = (i == PC_PAGE_FAULTS) ? faults_rusage() : 0;
+    }
+}
+
+/*
+ * perfctr_stop - compute the deltas since perfctr_start
+ */
+void perfctr_stop(perfctr_t *pc)
+{
+    int i;
+#ifdef __linux__
+    unsigned long long val[3];
+    double v;
+#endif
+
+    for (i = 0; i < PC_NEVENTS; i++) {
+	pc->valid[i] = 0;
+	pc->value[i] = 0;
+#ifdef __linux__
+	if (fds[i] >= 0) {
+	    if (read_event(fds[i], val)
+		&& (v = scale_event(start_reads[i], val)) >= 0) {
+		pc->value[i] = v;
+		pc->valid[i] = 1;
+	    }
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	    continue;
+	}
+#endif
+	if (i == PC_PAGE_FAULTS) {
+	    pc->value[i] = faults_rusage() - start_vals[i];
+	    pc->valid[i] = 1;
+	}
+    }
+}
+
+/*
+ * perfctr_name - the column name of an event
+ */
+const char *perfctr_name(int i)
+{
+    return names[i];
+}
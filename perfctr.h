@@ -0,0 +1,40 @@
+/*
+ * perfctr.h - prototypes for the routines in perfctr.c that count
+ *     memory-system and CPU events (page faults, TLB and cache misses,
+ *     instructions, branch misses) around a piece of code using the
+ *     Linux perf_event interface
+ */
+
+/* The events we know how to count; the first PC_NMEMEVENTS are the
+   memory-system events */
+enum {
+    PC_PAGE_FAULTS,     /* minor + major page faults */
+    PC_DTLB_MISSES,     /* data TLB load misses */
+    PC_INSTRUCTIONS,    /* instructions retired */
+    PC_BRANCH_MISSES,   /* mispredicted branches */
+    PC_L1D_MISSES,      /* L1 data cache load misses */
+    PC_LLC_MISSES,      /* last-level cache misses */
+    PC_NEVENTS
+};
+#define PC_NMEMEVENTS 2
+
+/* The deltas measured between perfctr_start and perfctr_stop */
+typedef struct {
+    double value[PC_NEVENTS];  /* event counts */
+    int valid[PC_NEVENTS];     /* is value[i] meaningful? */
+} perfctr_t;
+
+/* Open the counters; returns the number of events that can be counted */
+int perfctr_init(void);
+
+/* Close the counters (in a forked child, before perfctr_init) */
+void perfctr_close(void);
+
+/* Start counting */
+void perfctr_start(void);
+
+/* Stop counting and store the deltas since perfctr_start in *pc */
+void perfctr_stop(perfctr_t *pc);
+
+/* Short column name of event i */
+const char *perfctr_name(int i);
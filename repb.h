@@ -0,0 +1,45 @@
+/*
+ * repb.h - the requests of a trace as the driver replays them, and the
+ *     binary trace format (.repb) that stores them as is. Shared by
+ *     mdriver.c and the recorder in mmrec.c.
+ */
+#ifndef __REPB_H_
+#define __REPB_H_
+
+/* Types of trace operations */
+enum { ALLOC, FREE, REALLOC };
+
+/*
+ * Characterizes a single trace operation (allocator request). The
+ * layout is fixed, since binary traces store these records as is.
+ */
+typedef struct {
+	unsigned char type;   /* type of request: ALLOC, FREE or REALLOC */
+	unsigned char hint;   /* lifetime hint of alloc (MM_HINT_*) */
+	unsigned short thread; /* thread that makes the request (for -T) */
+	int index;            /* index for free() to use later */
+	unsigned int size;    /* byte size of alloc/realloc request */
+} traceop_t;
+
+/*
+ * A binary trace (.repb) is this header followed by num_ops traceop_t
+ * records, in host byte order. It is mapped, not read, so loading one
+ * costs nothing however long it is.
+ */
+#define REPB_MAGIC   "REPB"
+#define REPB_VERSION 2
+
+typedef struct {
+	char magic[4];
+	int version;
+	int weight;
+	int num_ids;
+	int num_ops;
+	int ignore_ranges;
+	long long mtime;     /* of the text trace this caches (-C), else 0 */
+} repb_header_t;
+
+/* Traces replayed with -T may use threads 0 to MAX_THREADS - 1 */
+#define MAX_THREADS 256
+
+#endif /* __REPB_H_ */